@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include "devices/ide.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* A block device. */
 struct block
@@ -113,6 +114,66 @@ check_sector (struct block *block, block_sector_t sector)
     }
 }
 
+/* Verifies that the CNT sectors starting at SECTOR all lie
+   within BLOCK.  Panics if not. */
+static void
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
+{
+  ASSERT (cnt > 0);
+  check_sector (block, sector);
+  if (cnt > block->size - sector)
+    PANIC ("Access past end of device %s (sector=%"PRDSNu", count=%zu, "
+           "size=%"PRDSNu")\n", block_name (block), sector, cnt,
+           block->size);
+}
+
+/* Completion function for requests made by transfer(). */
+static void
+transfer_done (struct block_request *r)
+{
+  sema_up (r->aux);
+}
+
+/* Transfers CNT sectors starting at SECTOR between BLOCK and
+   BUFFER, writing to BLOCK if WRITE is true and reading from it
+   otherwise, and waits for the transfer to complete.  Uses
+   whichever operations BLOCK's driver supplies. */
+static void
+transfer (struct block *block, bool write, block_sector_t sector,
+          void *buffer_, size_t cnt)
+{
+  const struct block_operations *ops = block->ops;
+  uint8_t *buffer = buffer_;
+  size_t i;
+
+  if (ops->submit != NULL)
+    {
+      struct semaphore done;
+      struct block_request r;
+
+      sema_init (&done, 0);
+      r.dev = block->aux;
+      r.write = write;
+      r.sector = sector;
+      r.cnt = cnt;
+      r.buffer = buffer;
+      r.done = transfer_done;
+      r.aux = &done;
+      ops->submit (block->aux, &r);
+      sema_down (&done);
+    }
+  else if (write && cnt > 1 && ops->write_multiple != NULL)
+    ops->write_multiple (block->aux, sector, buffer, cnt);
+  else if (!write && cnt > 1 && ops->read_multiple != NULL)
+    ops->read_multiple (block->aux, sector, buffer, cnt);
+  else
+    for (i = 0; i < cnt; i++)
+      if (write)
+        ops->write (block->aux, sector + i, buffer + i * BLOCK_SECTOR_SIZE);
+      else
+        ops->read (block->aux, sector + i, buffer + i * BLOCK_SECTOR_SIZE);
+}
+
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
    have room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to block devices, so external
@@ -121,7 +182,7 @@ void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
   check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
+  transfer (block, false, sector, buffer, 1);
   block->read_cnt++;
 }
 
@@ -135,10 +196,68 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
   check_sector (block, sector);
   ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
+  transfer (block, true, sector, (void *) buffer, 1);
   block->write_cnt++;
 }
 
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Drivers that support it do so with a single command.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     void *buffer, size_t cnt)
+{
+  check_sectors (block, sector, cnt);
+  transfer (block, false, sector, buffer, cnt);
+  block->read_cnt += cnt;
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving the
+   data.  Drivers that support it do so with a single command.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      const void *buffer, size_t cnt)
+{
+  check_sectors (block, sector, cnt);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  transfer (block, true, sector, (void *) buffer, cnt);
+  block->write_cnt += cnt;
+}
+
+/* Starts request R on BLOCK and returns, possibly before R is
+   done.  R->done is called when the transfer completes, which
+   may be before this function returns if BLOCK's driver cannot
+   queue requests. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  check_sectors (block, r->sector, r->cnt);
+  if (r->write)
+    {
+      ASSERT (block->type != BLOCK_FOREIGN);
+      block->write_cnt += r->cnt;
+    }
+  else
+    block->read_cnt += r->cnt;
+
+  if (block->ops->submit != NULL)
+    {
+      r->dev = block->aux;
+      block->ops->submit (block->aux, r);
+    }
+  else
+    {
+      transfer (block, r->write, r->sector, r->buffer, r->cnt);
+      r->done (r);
+    }
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include <stdbool.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -41,6 +43,25 @@ enum block_type
 
 const char *block_type_name (enum block_type);
 
+/* An asynchronous block request.  The submitter fills in every
+   member but ELEM and DEV and must leave the request alone until
+   DONE is called. */
+struct block_request
+  {
+    struct list_elem elem;              /* For the driver's use. */
+    void *dev;                          /* Driver's AUX for the device. */
+    bool write;                         /* Write (true) or read (false)? */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes. */
+
+    /* Called once the transfer completes, from a driver thread
+       that other requests are waiting on, so it should only
+       record the completion and wake up whoever needs to know. */
+    void (*done) (struct block_request *);
+    void *aux;                          /* For DONE's use. */
+  };
+
 /* Finding block devices. */
 struct block *block_get_role (enum block_type);
 void block_set_role (enum block_type, struct block *);
@@ -53,6 +74,10 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, void *, size_t cnt);
+void block_write_multiple (struct block *, block_sector_t, const void *,
+                           size_t cnt);
+void block_submit (struct block *, struct block_request *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
@@ -61,10 +86,25 @@ void block_print_stats (void);
 
 /* Lower-level interface to block device drivers. */
 
+/* A driver must supply either SUBMIT or READ and WRITE.  The
+   block layer implements whichever is missing in terms of the
+   other. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional.  Transfer CNT consecutive sectors at once.  If
+       null, the block layer calls read or write once per
+       sector instead. */
+    void (*read_multiple) (void *aux, block_sector_t, void *buffer,
+                           size_t cnt);
+    void (*write_multiple) (void *aux, block_sector_t, const void *buffer,
+                            size_t cnt);
+
+    /* Optional.  Queues REQUEST, whose DEV is AUX, and returns
+       without waiting for it. */
+    void (*submit) (void *aux, struct block_request *request);
   };
 
 struct block *block_register (const char *name, enum block_type,
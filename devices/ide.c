@@ -8,10 +8,22 @@
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].
+
+   Requests are queued per channel and carried out by the
+   channel's I/O thread, which is the only thread to touch the
+   controller once the disks have been identified.  The queue is
+   kept in sector order and served C-LOOK fashion: the thread
+   takes the first request at or beyond the sector where the last
+   transfer ended, wrapping around to the lowest sector when
+   there is none, and merges the requests that continue it into a
+   single command. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -30,10 +42,26 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, relative to the base found in
+   the controller's PCI configuration space [SFF-8038i]. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk into memory. */
+
+/* Bus master Status Register bits.  ERR and INTR are cleared by
+   writing 1 to them. */
+#define BM_STA_ERR 0x02         /* Transfer failed. */
+#define BM_STA_INTR 0x04        /* Disk raised its interrupt. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +77,15 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors that one command can transfer.  A sector count
+   register value of 0 means this many. */
+#define MAX_XFER_SECTORS 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,8 +94,23 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per interrupt in READ/WRITE
+                                   MULTIPLE, or 0 if not enabled. */
+    bool dma;                   /* Transfer with bus-master DMA? */
+  };
+
+/* A Physical Region Descriptor, one entry in the scatter/gather
+   list that a bus master DMA transfer works through. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address of region. */
+    uint16_t size;              /* Size in bytes, 0 meaning 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last entry. */
   };
 
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_CNT (PGSIZE / sizeof (struct prd))
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel
@@ -67,11 +119,21 @@ struct channel
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
 
-    struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base port, 0 if none. */
+    struct prd *prdt;           /* PRD table, PRD_CNT entries. */
+
+    struct lock queue_lock;     /* Protects queue. */
+    struct condition queue_cond; /* Signaled when queue becomes nonempty. */
+    struct list queue;          /* Pending block_requests, by sector. */
+    block_sector_t head_pos;    /* Sector after the last transfer. */
+
+    /* Sector buffers of the transfer in progress. */
+    uint8_t *xfer_bufs[MAX_XFER_SECTORS];
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -81,11 +143,21 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+/* Use bus-master DMA for disks that support it? */
+bool ide_dma;
+
+static uint16_t find_bus_master (void);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          bool write);
+
+static thread_func channel_thread NO_RETURN;
+
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, int);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -102,6 +174,7 @@ void
 ide_init (void) 
 {
   size_t chan_no;
+  uint16_t bm_base = ide_dma ? find_bus_master () : 0;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
@@ -123,9 +196,16 @@ ide_init (void)
         default:
           NOT_REACHED ();
         }
-      lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + chan_no * 8;
+        }
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,8 +216,18 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
+      /* Start the I/O thread, which partition_scan() needs once
+         a disk is registered. */
+      lock_init (&c->queue_lock);
+      cond_init (&c->queue_cond);
+      list_init (&c->queue);
+      c->head_pos = 0;
+      thread_create (c->name, PRI_DEFAULT, channel_thread, c);
+
       /* Register interrupt handler. */
       intr_register_ext (c->irq, interrupt_handler, c->name);
 
@@ -286,8 +376,14 @@ identify_ata_device (struct ata_disk *d)
   capacity = *(uint32_t *) &id[60 * 2];
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
+  d->dma = c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100) != 0;
   snprintf (extra_info, sizeof extra_info,
-            "model \"%s\", serial \"%s\"", model, serial);
+            "model \"%s\", serial \"%s\"%s", model, serial,
+            d->dma ? ", DMA" : "");
+
+  /* Word 47 gives the most sectors the disk will transfer per
+     interrupt under READ/WRITE MULTIPLE. */
+  set_multiple_mode (d, (uint8_t) id[47 * 2]);
 
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
@@ -309,6 +405,27 @@ identify_ata_device (struct ata_disk *d)
   partition_scan (block);
 }
 
+/* Enables READ/WRITE MULTIPLE on disk D with up to MAX sectors
+   per interrupt, leaving it disabled if MAX is less than 2 or the
+   disk refuses. */
+static void
+set_multiple_mode (struct ata_disk *d, int max)
+{
+  struct channel *c = d->channel;
+
+  d->multiple = 0;
+  if (max < 2)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), max);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_status (c)) & STA_ERR) == 0)
+    d->multiple = max;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +454,233 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+/* Reads CNT sectors, at most MAX_XFER_SECTORS, starting at
+   SEC_NO from disk D in PIO mode into the channel's xfer_bufs,
+   taking one interrupt per D->multiple sectors if READ MULTIPLE
+   is enabled. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
-  struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  size_t per_intr = d->multiple > 0 ? (size_t) d->multiple : 1;
+  size_t i = 0;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple > 0 ? CMD_READ_MULTIPLE
+                         : CMD_READ_SECTOR_RETRY));
+  while (i < cnt)
+    {
+      size_t block_end = cnt - i < per_intr ? cnt : i + per_intr;
+
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
+      for (; i < block_end; i++)
+        input_sector (c, c->xfer_bufs[i]);
+    }
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+/* Writes CNT sectors, at most MAX_XFER_SECTORS, starting at
+   SEC_NO to disk D in PIO mode from the channel's xfer_bufs,
+   taking one interrupt per D->multiple sectors if WRITE MULTIPLE
+   is enabled. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
+{
+  struct channel *c = d->channel;
+  size_t per_intr = d->multiple > 0 ? (size_t) d->multiple : 1;
+  size_t i = 0;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple > 0 ? CMD_WRITE_MULTIPLE
+                         : CMD_WRITE_SECTOR_RETRY));
+  while (i < cnt)
+    {
+      size_t block_end = cnt - i < per_intr ? cnt : i + per_intr;
+
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
+      for (; i < block_end; i++)
+        output_sector (c, c->xfer_bufs[i]);
+      sema_down (&c->completion_wait);
+    }
+}
+
+/* Orders block requests by sector. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+
+  return a->sector < b->sector;
+}
+
+/* Queues request R for disk D, whose channel's I/O thread will
+   carry it out. */
+static void
+ide_submit (void *d_, struct block_request *r)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+
+  ASSERT (r->dev == d);
+  ASSERT (r->sector + r->cnt <= (1UL << 28));
+
+  lock_acquire (&c->queue_lock);
+  list_insert_ordered (&c->queue, &r->elem, request_less, NULL);
+  cond_signal (&c->queue_cond, &c->queue_lock);
+  lock_release (&c->queue_lock);
 }
 
 static struct block_operations ide_operations =
   {
-    ide_read,
-    ide_write
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    ide_submit
   };
-
+
+/* Removes the next batch of requests from channel C's queue and
+   moves them to BATCH, whose requests all go to the same disk in
+   the same direction and cover consecutive sectors, no more than
+   MAX_XFER_SECTORS in all, unless the first request alone is
+   larger.  C's queue lock must be held and its queue must not be
+   empty. */
+static void
+take_batch (struct channel *c, struct list *batch)
+{
+  struct list_elem *e;
+  struct block_request *first, *last;
+  size_t cnt;
+
+  /* C-LOOK: the first request at or beyond the head, or else the
+     lowest-numbered one. */
+  for (e = list_begin (&c->queue); e != list_end (&c->queue);
+       e = list_next (e))
+    if (list_entry (e, struct block_request, elem)->sector >= c->head_pos)
+      break;
+  if (e == list_end (&c->queue))
+    e = list_begin (&c->queue);
+
+  first = last = list_entry (e, struct block_request, elem);
+  cnt = first->cnt;
+  e = list_remove (e);
+  list_push_back (batch, &first->elem);
+
+  /* Merge the requests that carry on where it ends. */
+  while (e != list_end (&c->queue))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+
+      if (r->sector > last->sector + last->cnt)
+        break;
+      if (r->sector != last->sector + last->cnt || r->dev != first->dev
+          || r->write != first->write || cnt + r->cnt > MAX_XFER_SECTORS)
+        {
+          e = list_next (e);
+          continue;
+        }
+      e = list_remove (e);
+      list_push_back (batch, &r->elem);
+      last = r;
+      cnt += r->cnt;
+    }
+
+  c->head_pos = last->sector + last->cnt;
+}
+
+/* Transfers CNT sectors, at most MAX_XFER_SECTORS, starting at
+   SEC_NO between disk D and its channel's xfer_bufs with a single
+   command, writing to D if WRITE is true.  Uses DMA if possible,
+   PIO otherwise. */
+static void
+transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt, bool write)
+{
+  if (d->dma && dma_transfer (d, sec_no, cnt, write))
+    return;
+  if (write)
+    pio_write (d, sec_no, cnt);
+  else
+    pio_read (d, sec_no, cnt);
+}
+
+/* Carries out the requests in BATCH, as chosen by take_batch(),
+   on channel C. */
+static void
+do_batch (struct channel *c, struct list *batch)
+{
+  struct block_request *first = list_entry (list_front (batch),
+                                            struct block_request, elem);
+  struct ata_disk *d = first->dev;
+  block_sector_t sec_no = first->sector;
+  struct list_elem *e;
+  size_t cnt = 0;
+
+  for (e = list_begin (batch); e != list_end (batch); e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      size_t i;
+
+      for (i = 0; i < r->cnt; i++)
+        {
+          c->xfer_bufs[cnt++] = (uint8_t *) r->buffer + i * BLOCK_SECTOR_SIZE;
+          if (cnt == MAX_XFER_SECTORS)
+            {
+              transfer (d, sec_no, cnt, first->write);
+              sec_no += cnt;
+              cnt = 0;
+            }
+        }
+    }
+  if (cnt > 0)
+    transfer (d, sec_no, cnt, first->write);
+}
+
+/* I/O thread for the channel passed as AUX.  Serves the
+   channel's request queue forever. */
+static void
+channel_thread (void *c_)
+{
+  struct channel *c = c_;
+
+  for (;;)
+    {
+      struct list batch;
+
+      list_init (&batch);
+      lock_acquire (&c->queue_lock);
+      while (list_empty (&c->queue))
+        cond_wait (&c->queue_cond, &c->queue_lock);
+      take_batch (c, &batch);
+      lock_release (&c->queue_lock);
+
+      do_batch (c, &batch);
+      while (!list_empty (&batch))
+        {
+          struct block_request *r = list_entry (list_pop_front (&batch),
+                                                struct block_request, elem);
+          r->done (r);
+        }
+    }
+}
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the sector count CNT, which must be between 1
+   and MAX_XFER_SECTORS, to the disk's sector selection registers.
+   (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_XFER_SECTORS);
+  ASSERT (sec_no + cnt <= (1UL << 28));
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_XFER_SECTORS);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -430,6 +717,152 @@ output_sector (struct channel *c, const void *sector)
   outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
 }
 
+/* Bus master DMA. */
+
+/* PCI configuration space access ports. */
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/* Returns the 32-bit register at offset REG in the configuration
+   space of PCI function BUS:DEV.FUNC. */
+static uint32_t
+pci_read_config (int bus, int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDR, (0x80000000 | (bus << 16) | (dev << 11)
+                          | (func << 8) | (reg & 0xfc)));
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes DATA to the 32-bit register at offset REG in the
+   configuration space of PCI function BUS:DEV.FUNC. */
+static void
+pci_write_config (int bus, int dev, int func, int reg, uint32_t data)
+{
+  outl (PCI_CONFIG_ADDR, (0x80000000 | (bus << 16) | (dev << 11)
+                          | (func << 8) | (reg & 0xfc)));
+  outl (PCI_CONFIG_DATA, data);
+}
+
+/* Looks on PCI bus 0 for an IDE controller capable of bus
+   mastering, such as the PIIX emulated by QEMU and Bochs, and
+   enables bus mastering on it.  Returns its bus master base port,
+   or 0 if there is none. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class, bar4, command;
+
+        if ((pci_read_config (0, dev, func, 0x00) & 0xffff) == 0xffff)
+          continue;
+
+        /* Class 01h (mass storage), subclass 01h (IDE), with
+           programming interface bit 7 (bus master) set. */
+        class = pci_read_config (0, dev, func, 0x08) >> 8;
+        if ((class >> 8) != 0x0101 || (class & 0x80) == 0)
+          continue;
+
+        /* BAR4 holds the bus master base in I/O space. */
+        bar4 = pci_read_config (0, dev, func, 0x20);
+        if ((bar4 & 1) == 0 || (bar4 & 0xfffc) == 0)
+          continue;
+
+        /* Enable I/O space decoding and bus mastering. */
+        command = pci_read_config (0, dev, func, 0x04);
+        pci_write_config (0, dev, func, 0x04, command | 0x05);
+        return bar4 & 0xfffc;
+      }
+  return 0;
+}
+
+/* Fills in channel C's PRD table to describe the CNT sectors in
+   C's xfer_bufs, each of which is a kernel virtual address,
+   merging sectors that are adjacent in physical memory.  Returns
+   false if some buffer is unsuitable for DMA. */
+static bool
+build_prdt (struct channel *c, size_t cnt)
+{
+  size_t prd_cnt = 0;
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    {
+      uint8_t *buffer = c->xfer_bufs[i];
+      uint32_t addr;
+      size_t size;
+
+      if (!is_kernel_vaddr (buffer) || ((uintptr_t) buffer & 1) != 0)
+        return false;
+
+      /* No region may cross a 64 kB boundary. */
+      addr = vtop (buffer);
+      for (size = BLOCK_SECTOR_SIZE; size > 0; )
+        {
+          struct prd *prev = prd_cnt > 0 ? &c->prdt[prd_cnt - 1] : NULL;
+          size_t chunk = 0x10000 - (addr & 0xffff);
+          if (chunk > size)
+            chunk = size;
+
+          if (prev != NULL && prev->size != 0
+              && prev->addr + prev->size == addr
+              && (addr & 0xffff) != 0)
+            prev->size += chunk;
+          else
+            {
+              if (prd_cnt >= PRD_CNT)
+                return false;
+              c->prdt[prd_cnt].addr = addr;
+              c->prdt[prd_cnt].size = chunk & 0xffff;
+              c->prdt[prd_cnt].flags = 0;
+              prd_cnt++;
+            }
+          addr += chunk;
+          size -= chunk;
+        }
+    }
+  c->prdt[prd_cnt - 1].flags = PRD_EOT;
+  return true;
+}
+
+/* Transfers CNT sectors, at most MAX_XFER_SECTORS, starting at
+   SEC_NO between disk D and its channel's xfer_bufs by bus master
+   DMA, reading into them if WRITE is false and writing from them
+   otherwise.  The CPU is free for other threads until the
+   completion interrupt.  Returns false without doing anything if
+   the buffers cannot be used for DMA. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              bool write)
+{
+  struct channel *c = d->channel;
+  uint8_t bm_status;
+
+  if (!build_prdt (c, cnt))
+    return false;
+
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), write ? 0 : BM_CMD_READ);
+  outb (reg_bm_status (c), BM_STA_ERR | BM_STA_INTR);
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+  sema_down (&c->completion_wait);
+
+  outb (reg_bm_command (c), write ? 0 : BM_CMD_READ);
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), BM_STA_ERR | BM_STA_INTR);
+  if ((bm_status & BM_STA_ERR) != 0
+      || (inb (reg_alt_status (c)) & STA_ERR) != 0)
+    PANIC ("%s: DMA %s failed, sector=%"PRDSNu,
+           d->name, write ? "write" : "read", sec_no);
+  return true;
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
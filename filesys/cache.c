@@ -1,6 +1,9 @@
 #include "devices/block.h"
 #include <list.h>
+#include <hash.h>
 #include <bitmap.h>
+#include <round.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -8,96 +11,547 @@
 #include "threads/synch.h"
 #include "threads/thread.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+#include "threads/interrupt.h"
+#include "devices/timer.h"
 #include "filesys/cache.h"
+#include "filesys/journal.h"
+
+/* The cache is split into CACHE_SHARD_CNT shards, chosen by a
+   hash of the sector number.  Each shard owns a fixed slice of
+   the entries and has its own lock, map and clock hand, so a
+   miss in one shard never waits on another.
+
+   Lock order: an entry's lock may be acquired while holding its
+   shard's lock only with lock_try_acquire(), or for an entry on
+   the shard's free list.  Disk I/O is never done with a shard
+   lock held. */
+#define CACHE_SHARD_CNT 8
+
+/* Replacement is a segmented variant of 2Q.  A newly cached
+   sector enters its shard's probation queue, which is run FIFO,
+   and is promoted to the protected queue only if it is referenced
+   again before it reaches the head.  A sector touched once, as by
+   a long sequential read, therefore never displaces sectors in
+   the protected queue.  The protected queue is limited to
+   CACHE_PROTECTED_PCT percent of the shard; when it overflows, its
+   least recently referenced entry is demoted back to probation
+   with one reference in hand, so that a single further use saves
+   it.
+
+   Metadata sectors (inodes, indirect blocks, directories and the
+   free map) skip probation, and are demoted only when the
+   protected queue holds no unreferenced data sector. */
+#define CACHE_PROTECTED_PCT 75
+
+/* A sector referenced this many times while on probation is
+   promoted. */
+#define CACHE_PROMOTE_REFS 2
+
+/* References to a sector are correlated, and count as one, until
+   this percentage of its shard's entries' worth of other sectors
+   has entered the shard.  Several small reads of one sector during
+   a single sequential scan thus do not promote it. */
+#define CACHE_CORRELATED_PCT 10
+
+/* Smallest cache we will build, so that every shard has a few
+   entries to evict from. */
+#define CACHE_MIN_SECTORS (CACHE_SHARD_CNT * 4)
+
+/* Percentage of the cache that may be dirty before the write-back
+   daemon is woken ahead of its next periodic pass. */
+#define CACHE_DIRTY_HIGH_PCT 25
 
 struct cache_entry
   {
+    struct hash_elem hash_elem;         /* Element in shard's map. */
+    struct list_elem queue_elem;        /* Element in shard's free,
+                                           probation or protected list. */
     block_sector_t sector;
     bool valid;
     bool dirty;
-    bool accessed;
     bool loaded;
-    unsigned long long read_cnt;
-    unsigned long long write_cnt;
+    bool meta;                          /* Holds file system metadata? */
+    bool protected;                     /* In protected queue? */
+    uint8_t refs;                       /* References since last examined
+                                           by the replacement policy. */
+    unsigned ref_tick;                  /* Shard's ticks at the last
+                                           reference counted in refs. */
+    bool prefetched;                    /* Loaded by read-ahead and not
+                                           yet accessed? */
+    bool logged;                        /* Dirtied by an operation in the
+                                           journal's running transaction? */
     struct lock lock;
 
-    uint8_t buffer[BLOCK_SECTOR_SIZE];
+    uint8_t *buffer;                    /* BLOCK_SECTOR_SIZE bytes. */
   };
 
-struct queue_entry
+/* A shard of the buffer cache. */
+struct cache_shard
   {
-    int index;
-    struct list_elem elem;
+    struct lock lock;                   /* Protects map, lists, hand. */
+    struct hash map;                    /* Valid entries, keyed by sector. */
+    struct list free_entries;           /* Entries not holding a sector. */
+    struct list probation;              /* Entries referenced once, FIFO. */
+    struct list protected;              /* Entries referenced again. */
+    size_t protected_cnt;               /* Length of protected. */
+    size_t protected_max;               /* Demote beyond this length. */
+    struct cache_entry *entries;        /* First entry of this shard. */
+    size_t entry_cnt;                   /* Number of entries. */
+    size_t hand;                        /* Write-back hand, index into
+                                           entries. */
+    unsigned ticks;                     /* Sectors that have entered. */
+    unsigned correlated;                /* Ticks within which references
+                                           are correlated. */
   };
 
-static struct list read_queue;
-static struct semaphore read_sema;
+/* A dirty sector queued for write-back by cache_flush(). */
+struct flush_entry
+  {
+    block_sector_t sector;              /* Sector when queued. */
+    struct cache_entry *cache_entry;    /* Null once dealt with. */
+    bool submitted;                     /* Write in flight? */
+    struct block_request request;       /* The write. */
+  };
+
+/* Maximum number of sectors waiting for the read-ahead thread.
+   Requests beyond this are dropped, since read-ahead is only a
+   hint. */
+#define READ_QUEUE_SIZE 128
+
+/* Most sectors the read-ahead thread has in flight at once. */
+#define READ_BATCH_SIZE 16
+
+/* Number of sectors held by the buffer cache. */
+size_t cache_sector_cnt = CACHE_DEFAULT_SECTORS;
+
+/* Milliseconds between periodic passes of the write-back daemon. */
+unsigned cache_flush_ms = CACHE_DEFAULT_FLUSH_MS;
+
+static block_sector_t read_queue[READ_QUEUE_SIZE]; /* Ring buffer. */
+static size_t read_head;                /* Next slot to fill. */
+static size_t read_tail;                /* Next slot to drain. */
+static struct lock read_lock;           /* Protects read_queue. */
+static struct semaphore read_sema;      /* Counts queued sectors. */
+
+static struct cache_entry *cache;       /* cache_sector_cnt entries. */
+static struct cache_shard shards[CACHE_SHARD_CNT];
+
+static size_t dirty_cnt;                /* Number of dirty entries. */
+static size_t dirty_high;               /* Wake write-back above this. */
+static bool flush_pending;              /* flush_sema already up'd? */
+static struct semaphore flush_sema;     /* Wakes the write-back daemon. */
+static struct lock flush_lock;          /* Serializes cache_flush(). */
+static struct flush_entry *flush_list;  /* cache_sector_cnt entries. */
 
-static struct cache_entry cache[64];
-static struct lock cache_lock;
-static int iter_idx;
+/* Statistics.  Updated with interrupts disabled. */
+static struct cache_stats stats;
 
 void write_back (void *);
+void flush_timer (void *);
 void read_ahead (void *);
-static int cache_evict (void);
+static struct cache_entry *cache_get (block_sector_t, bool meta, bool wait);
+static struct cache_entry *cache_allocate (block_sector_t, bool meta);
+static struct cache_entry *cache_evict (struct cache_shard *);
+static hash_hash_func cache_hash;
+static hash_less_func cache_less;
 
 void
 cache_init (void)
 {
-  lock_init (&cache_lock);
-  sema_init (&read_sema, 0);
-  list_init (&read_queue);
-  for (int i = 0; i < 64; i++)
+  size_t buffer_pages;
+  uint8_t *buffers;
+
+  if (cache_sector_cnt < CACHE_MIN_SECTORS)
+    cache_sector_cnt = CACHE_MIN_SECTORS;
+
+  /* Sector buffers are carved out of whole pages so that no
+     buffer straddles a page boundary. */
+  buffer_pages = DIV_ROUND_UP (cache_sector_cnt * BLOCK_SECTOR_SIZE, PGSIZE);
+  cache = calloc (cache_sector_cnt, sizeof *cache);
+  flush_list = calloc (cache_sector_cnt, sizeof *flush_list);
+  buffers = palloc_get_multiple (0, buffer_pages);
+  if (cache == NULL || flush_list == NULL || buffers == NULL)
+    PANIC ("buffer cache allocation failed--%zu sectors is too many",
+           cache_sector_cnt);
+
+  for (size_t i = 0; i < cache_sector_cnt; i++)
   {
     lock_init (&cache[i].lock);
     cache[i].valid = 0;
+    cache[i].buffer = buffers + i * BLOCK_SECTOR_SIZE;
+  }
+
+  for (size_t i = 0; i < CACHE_SHARD_CNT; i++)
+  {
+    struct cache_shard *s = &shards[i];
+    size_t first = i * cache_sector_cnt / CACHE_SHARD_CNT;
+    size_t last = (i + 1) * cache_sector_cnt / CACHE_SHARD_CNT;
+
+    lock_init (&s->lock);
+    if (!hash_init (&s->map, cache_hash, cache_less, NULL))
+      PANIC ("buffer cache allocation failed");
+    list_init (&s->free_entries);
+    list_init (&s->probation);
+    list_init (&s->protected);
+    s->entries = cache + first;
+    s->entry_cnt = last - first;
+    s->protected_cnt = 0;
+    s->protected_max = s->entry_cnt * CACHE_PROTECTED_PCT / 100;
+    s->hand = 0;
+    s->ticks = 0;
+    s->correlated = s->entry_cnt * CACHE_CORRELATED_PCT / 100 + 1;
+    for (size_t j = 0; j < s->entry_cnt; j++)
+      list_push_back (&s->free_entries, &s->entries[j].queue_elem);
   }
-  iter_idx = 0;
+
+  dirty_cnt = 0;
+  dirty_high = cache_sector_cnt * CACHE_DIRTY_HIGH_PCT / 100;
+  flush_pending = false;
+  sema_init (&flush_sema, 0);
+  lock_init (&flush_lock);
+
+  lock_init (&read_lock);
+  sema_init (&read_sema, 0);
+  read_head = read_tail = 0;
   thread_create ("read-ahead", PRI_DEFAULT, read_ahead, NULL);
-  // thread_create ("write-back", PRI_DEFAULT, write_back, NULL);
+  thread_create ("write-back", PRI_DEFAULT, write_back, NULL);
+  if (cache_flush_ms > 0)
+    thread_create ("flush-timer", PRI_DEFAULT, flush_timer, NULL);
 }
 
-/* Find cache entry and return it. If not found, allocate a new entry and return it.
-   Data is not read into buffer yet */
-static int
-cache_allocate (block_sector_t sector)
+static unsigned
+cache_hash (const struct hash_elem *e, void *aux UNUSED)
 {
-  int idx = -1;
+  const struct cache_entry *c = hash_entry (e, struct cache_entry, hash_elem);
+  return hash_int (c->sector);
+}
+
+static bool
+cache_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  const struct cache_entry *c_a = hash_entry (a, struct cache_entry, hash_elem);
+  const struct cache_entry *c_b = hash_entry (b, struct cache_entry, hash_elem);
+  return c_a->sector < c_b->sector;
+}
 
-  lock_acquire (&cache_lock);
-  for (int i = 0; i < 64; i ++)
+/* Adds one to statistic *CNT. */
+static void
+cache_count (unsigned long long *cnt)
+{
+  enum intr_level old_level = intr_disable ();
+  (*cnt)++;
+  intr_set_level (old_level);
+}
+
+/* Acquires LOCK, recording in the statistics how long we had to
+   wait for it, if at all. */
+static void
+cache_lock (struct lock *lock)
+{
+  enum intr_level old_level;
+  int64_t start;
+
+  if (lock_try_acquire (lock))
+    return;
+
+  start = timer_ticks ();
+  lock_acquire (lock);
+
+  old_level = intr_disable ();
+  stats.lock_waits++;
+  stats.lock_wait_ticks += timer_elapsed (start);
+  intr_set_level (old_level);
+}
+
+/* Returns the shard responsible for SECTOR. */
+static struct cache_shard *
+sector_to_shard (block_sector_t sector)
+{
+  return &shards[hash_int (sector) % CACHE_SHARD_CNT];
+}
+
+/* Returns the valid cache entry holding SECTOR in shard S, or a
+   null pointer if SECTOR is not cached.  Must be called with S's
+   lock held. */
+static struct cache_entry *
+cache_lookup (struct cache_shard *s, block_sector_t sector)
+{
+  struct cache_entry key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&s->map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct cache_entry, hash_elem) : NULL;
+}
+
+/* Returns true if SECTOR is cached.  The answer may be stale by
+   the time the caller acts on it. */
+static bool
+cache_contains (block_sector_t sector)
+{
+  struct cache_shard *s = sector_to_shard (sector);
+  bool cached;
+
+  lock_acquire (&s->lock);
+  cached = cache_lookup (s, sector) != NULL;
+  lock_release (&s->lock);
+  return cached;
+}
+
+/* Appends C to shard S's protected queue.  S's lock must be
+   held. */
+static void
+cache_protect (struct cache_shard *s, struct cache_entry *c)
+{
+  c->protected = true;
+  c->refs = 0;
+  list_push_back (&s->protected, &c->queue_elem);
+  s->protected_cnt++;
+}
+
+/* Removes C from whichever of shard S's queues it is on.  S's
+   lock must be held. */
+static void
+cache_unqueue (struct cache_shard *s, struct cache_entry *c)
+{
+  list_remove (&c->queue_elem);
+  if (c->protected)
   {
-    if (cache[i].sector == sector && cache[i].valid)
+    c->protected = false;
+    s->protected_cnt--;
+  }
+}
+
+/* Counts an access to C, whose lock must be held, as a hit or a
+   miss, before any load it requires. */
+static void
+cache_count_access (struct cache_entry *c)
+{
+  enum intr_level old_level = intr_disable ();
+  if (!c->loaded)
+    stats.misses++;
+  else
+  {
+    stats.hits++;
+    if (c->prefetched)
+      stats.ra_used++;
+  }
+  intr_set_level (old_level);
+  c->prefetched = false;
+}
+
+/* Records a reference to C, whose lock must be held.  META is
+   true if C holds file system metadata.  A reference correlated
+   with the last one counted is ignored. */
+static void
+cache_touch (struct cache_entry *c, bool meta)
+{
+  struct cache_shard *s = sector_to_shard (c->sector);
+  unsigned now = s->ticks;
+
+  if (now - c->ref_tick >= s->correlated)
+  {
+    c->ref_tick = now;
+    if (c->refs < CACHE_PROMOTE_REFS)
+      c->refs++;
+  }
+  if (meta)
+    c->meta = true;
+}
+
+/* Find cache entry and return it with its lock held. If not found,
+   allocate a new entry and return it.  Data is not read into
+   buffer yet.  META is true if SECTOR holds file system metadata,
+   which is placed directly in the protected queue. */
+static struct cache_entry *
+cache_allocate (block_sector_t sector, bool meta)
+{
+  return cache_get (sector, meta, true);
+}
+
+/* Like cache_allocate(), but if WAIT is false, returns a null
+   pointer instead of waiting for another entry's lock: if SECTOR's
+   shard has no entry that can be evicted at once, or if SECTOR is
+   already cached.  A caller that passes false should check for
+   the latter with cache_contains() first, so that a null pointer
+   almost always means the former. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool meta, bool wait)
+{
+  struct cache_shard *s = sector_to_shard (sector);
+  struct cache_entry *c;
+
+  for (;;)
+  {
+    cache_lock (&s->lock);
+    c = cache_lookup (s, sector);
+    if (c != NULL)
+    {
+      /* Wait for the entry outside the shard lock.  It may have
+         been recycled for another sector in the meantime. */
+      lock_release (&s->lock);
+      if (!wait)
+        return NULL;
+      cache_lock (&c->lock);
+      if (c->valid && c->sector == sector)
+        return c;
+      lock_release (&c->lock);
+      continue;
+    }
+
+    if (!list_empty (&s->free_entries))
+    {
+      c = list_entry (list_pop_front (&s->free_entries), struct cache_entry,
+                      queue_elem);
+      lock_acquire (&c->lock);
+    }
+    else
     {
-      lock_acquire (&cache[i].lock);
-      lock_release (&cache_lock);
-      return i;
+      c = cache_evict (s);
+      if (c == NULL)
+      {
+        if (!wait)
+          return NULL;
+        continue;
+      }
     }
-    else if (!cache[i].valid)
-      idx = i;
+    break;
   }
 
-  if (idx != -1)
+  // Insert here
+  c->sector = sector;
+  c->valid = 1;
+  c->dirty = 0;
+  c->loaded = 0;
+  c->prefetched = false;
+  c->logged = false;
+  c->meta = meta;
+  c->ref_tick = s->ticks++ - s->correlated;
+  hash_insert (&s->map, &c->hash_elem);
+  if (meta)
+    cache_protect (s, c);
+  else
   {
-    lock_acquire (&cache[idx].lock);
+    c->protected = false;
+    c->refs = 0;
+    list_push_back (&s->probation, &c->queue_elem);
   }
-  else
+
+  lock_release (&s->lock);
+
+  return c;
+}
+
+/* Wakes the write-back daemon unless a wake-up is already
+   pending. */
+static void
+cache_wake_flusher (void)
+{
+  enum intr_level old_level = intr_disable ();
+  if (!flush_pending)
   {
-    idx = cache_evict ();
+    flush_pending = true;
+    sema_up (&flush_sema);
   }
+  intr_set_level (old_level);
+}
 
-  // Insert here
-  cache[idx].sector = sector;
-  cache[idx].valid = 1;
-  cache[idx].dirty = 0;
-  cache[idx].accessed = 0;
-  cache[idx].read_cnt = 0;
-  cache[idx].write_cnt = 0;
-  cache[idx].loaded = 0;
+/* Marks C, whose lock must be held, as dirty.  Wakes the
+   write-back daemon early if too much of the cache is dirty. */
+static void
+cache_mark_dirty (struct cache_entry *c)
+{
+  enum intr_level old_level;
+  bool wake;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+  if (c->dirty)
+    return;
+
+  c->dirty = 1;
+  old_level = intr_disable ();
+  wake = ++dirty_cnt > dirty_high;
+  intr_set_level (old_level);
+
+  if (wake)
+    cache_wake_flusher ();
+}
+
+/* Marks C, whose lock must be held, dirty on behalf of a
+   metadata update, logging it in the journal's running
+   transaction. */
+static void
+cache_log (struct cache_entry *c)
+{
+  cache_mark_dirty (c);
+  if (!c->logged)
+  {
+    c->logged = true;
+    journal_log (c->sector);
+  }
+}
+
+/* Marks C, whose lock must be held, clean once its contents
+   have been written to disk. */
+static void
+cache_cleaned (struct cache_entry *c)
+{
+  enum intr_level old_level;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+  ASSERT (c->dirty);
+
+  c->dirty = 0;
+  old_level = intr_disable ();
+  dirty_cnt--;
+  stats.write_backs++;
+  intr_set_level (old_level);
+}
+
+/* Writes C, whose lock must be held, back if it is dirty: to the
+   journal if it is logged, otherwise to disk. */
+static void
+cache_clean (struct cache_entry *c)
+{
+  ASSERT (lock_held_by_current_thread (&c->lock));
+  if (!c->dirty)
+    return;
 
-  lock_release (&cache_lock);
+  if (c->logged)
+  {
+    journal_save (c->sector, c->buffer);
+    c->logged = false;
+  }
+  else
+    block_write (fs_device, c->sector, c->buffer);
+  cache_cleaned (c);
+}
 
-  return idx;
+/* Completion function for the cache's asynchronous requests,
+   whose AUX is a semaphore counting completions. */
+static void
+cache_io_done (struct block_request *r)
+{
+  sema_up (r->aux);
+}
+
+/* Starts an asynchronous transfer of the sector held by C between
+   disk and C's buffer using request R.  Ups DONE when it
+   completes. */
+static void
+cache_submit (struct cache_entry *c, struct block_request *r, bool write,
+              struct semaphore *done)
+{
+  r->write = write;
+  r->sector = c->sector;
+  r->cnt = 1;
+  r->buffer = c->buffer;
+  r->done = cache_io_done;
+  r->aux = done;
+  block_submit (fs_device, r);
 }
 
 static void
@@ -105,178 +559,508 @@ cache_load (struct cache_entry *cache_entry)
 {
   ASSERT (cache_entry != NULL);
 
-
-  memset (cache_entry->buffer, 0, BLOCK_SECTOR_SIZE);
-  block_read (fs_device, cache_entry->sector, cache_entry->buffer);
+  /* A logged sector written back since it was last cached is
+     current only in the journal. */
+  if (!journal_read (cache_entry->sector, cache_entry->buffer))
+    block_read (fs_device, cache_entry->sector, cache_entry->buffer);
   cache_entry->loaded = 1;
 }
 
-static int
-cache_evict (void)
+/* Returns true if C can be taken as an eviction victim by the
+   running thread right now, acquiring C's lock if so. */
+static bool
+cache_try_victim (struct cache_entry *c)
 {
-  while (1)
+  return (c->loaded && !lock_held_by_current_thread (&c->lock)
+          && lock_try_acquire (&c->lock));
+}
+
+/* Moves one entry from shard S's protected queue to the tail of
+   its probation queue, giving each entry a second chance if it
+   has been referenced since it was last examined, and metadata a
+   further pass.  Does nothing if the protected queue is empty.
+   S's lock must be held. */
+static void
+cache_demote (struct cache_shard *s)
+{
+  size_t cnt = s->protected_cnt;
+
+  for (size_t i = 0; i < 2 * cnt; i++)
+  {
+    struct cache_entry *c = list_entry (list_front (&s->protected),
+                                        struct cache_entry, queue_elem);
+
+    list_remove (&c->queue_elem);
+    if (c->refs > 0 || (c->meta && i < cnt))
+    {
+      c->refs = 0;
+      list_push_back (&s->protected, &c->queue_elem);
+      continue;
+    }
+
+    c->protected = false;
+    s->protected_cnt--;
+    c->refs = CACHE_PROMOTE_REFS - 1;
+    list_push_back (&s->probation, &c->queue_elem);
+    return;
+  }
+}
+
+/* Chooses a clean victim from the head of shard S's probation
+   queue, promoting any entry referenced again while it waited,
+   and unmaps it.  Returns the victim with its lock held and S's
+   lock still held.  Dirty entries are passed over, since the
+   write-back daemon should clean them shortly.
+
+   If the shard holds no clean candidate, writes a dirty one back
+   with only the entry's lock held and returns a null pointer;
+   likewise if every entry is busy.  In both cases S's lock has
+   been released and the caller must retry, since S may have
+   changed meanwhile. */
+static struct cache_entry *
+cache_evict (struct cache_shard *s)
+{
+  bool saw_dirty = false;
+
+  for (size_t i = 0; i < 2 * s->entry_cnt; i++)
+  {
+    struct cache_entry *c;
+
+    if (list_empty (&s->probation) || s->protected_cnt > s->protected_max)
+      cache_demote (s);
+    if (list_empty (&s->probation))
+      break;
+
+    c = list_entry (list_pop_front (&s->probation), struct cache_entry,
+                    queue_elem);
+    ASSERT (c->valid == 1);
+    if (c->refs >= CACHE_PROMOTE_REFS)
+    {
+      cache_protect (s, c);
+      continue;
+    }
+
+    /* Requeue the entry in case it cannot be taken. */
+    list_push_back (&s->probation, &c->queue_elem);
+    if (c->dirty)
+      saw_dirty = true;
+    else if (cache_try_victim (c))
+    {
+      if (c->dirty)
+      {
+        /* Dirtied since we looked. */
+        lock_release (&c->lock);
+        continue;
+      }
+      cache_unqueue (s, c);
+      hash_delete (&s->map, &c->hash_elem);
+      cache_count (&stats.evictions);
+      return c;
+    }
+  }
+
+  if (saw_dirty)
   {
-    for (int i = iter_idx; i < 64; i++)
+    cache_wake_flusher ();
+    for (size_t i = 0; i < s->entry_cnt; i++)
     {
-      ASSERT (cache[i].valid == 1);
-      if (cache[i].accessed)
-        cache[i].accessed = 0;
-      else if (cache[i].loaded)
+      struct cache_entry *c = &s->entries[s->hand];
+
+      s->hand = (s->hand + 1) % s->entry_cnt;
+      if (c->dirty && cache_try_victim (c))
       {
-        if (lock_try_acquire (&cache[i].lock))
-        {
-          iter_idx = i + 1;
-          // Write back
-          if (cache[i].dirty)
-            block_write (fs_device, cache[i].sector, cache[i].buffer);
-
-          return i;
-        }
+        /* The entry stays mapped during the write, so readers of
+           its sector wait on its lock instead of rereading stale
+           data from disk. */
+        lock_release (&s->lock);
+        cache_clean (c);
+        lock_release (&c->lock);
+        cache_count (&stats.evict_writes);
+        return NULL;
       }
     }
-    iter_idx = 0;
   }
+
+  /* Every entry is in use.  Let their holders make progress. */
+  lock_release (&s->lock);
+  thread_yield ();
+  return NULL;
 }
 
 void
-cache_write_at (block_sector_t sector, const void *buffer, int ofs, int size)
+cache_write_at (block_sector_t sector, const void *buffer, int ofs, int size,
+                bool meta)
 {
-  int idx = cache_allocate (sector);
+  struct cache_entry *c = cache_allocate (sector, meta);
+
+  cache_count_access (c);
 
-  if (!cache[idx].loaded)
-    cache_load (&cache[idx]);
+  /* A whole-sector write need not read the old contents first. */
+  if (!c->loaded && ofs == 0 && size == BLOCK_SECTOR_SIZE)
+    c->loaded = 1;
+  else if (!c->loaded)
+    cache_load (c);
 
-  memcpy (cache[idx].buffer + ofs, buffer, size);
-  cache[idx].dirty = 1;
-  cache[idx].accessed = 1;
-  lock_release (&cache[idx].lock);
+  memcpy (c->buffer + ofs, buffer, size);
+  if (meta)
+    cache_log (c);
+  else
+    cache_mark_dirty (c);
+  cache_touch (c, meta);
+  lock_release (&c->lock);
 }
 
 
 void
-cache_read_at (block_sector_t sector, void *buffer, int ofs, int size)
+cache_read_at (block_sector_t sector, void *buffer, int ofs, int size,
+               bool meta)
 {
-  int idx = cache_allocate (sector);
+  struct cache_entry *c = cache_allocate (sector, meta);
 
-  if (!cache[idx].loaded)
-    cache_load (&cache[idx]);
+  cache_count_access (c);
+  if (!c->loaded)
+    cache_load (c);
 
-  memcpy (buffer, cache[idx].buffer + ofs, size);
-  cache[idx].accessed = 1;
-  lock_release (&cache[idx].lock);
+  memcpy (buffer, c->buffer + ofs, size);
+  cache_touch (c, meta);
+  lock_release (&c->lock);
+}
 
+/* Pins SECTOR in the cache, reading it from disk if necessary, and
+   returns its entry.  The caller has exclusive access to the
+   sector's data through cache_buffer() until it calls
+   cache_unpin().  A thread may hold several pins at once, but
+   should release them promptly, since a pinned entry cannot be
+   evicted.  Pinned sectors are treated as metadata by the
+   replacement policy. */
+struct cache_entry *
+cache_pin (block_sector_t sector)
+{
+  struct cache_entry *c = cache_allocate (sector, true);
 
-  // Read ahead
-  if (sector + 1 < block_size (fs_device))
-  {
-    int next = cache_allocate (sector + 1);
+  cache_count_access (c);
+  if (!c->loaded)
+    cache_load (c);
+  cache_touch (c, true);
+  return c;
+}
 
-    if (!cache[next].loaded)
-    {
-      lock_acquire (&cache_lock);
-      //put into queue
-      struct queue_entry *new = malloc (sizeof (struct queue_entry));
-      new->index = next;
+/* Like cache_pin(), but for a sector whose old contents do not
+   matter, such as one just allocated: fills the buffer with zeros
+   instead of reading the disk. */
+struct cache_entry *
+cache_pin_zeroed (block_sector_t sector)
+{
+  struct cache_entry *c = cache_allocate (sector, true);
 
-      if (list_empty (&read_queue))
-      {
-        list_push_back (&read_queue, &new->elem);
-        sema_up (&read_sema);
-      }
-      else
-        list_push_back (&read_queue, &new->elem);
-      lock_release (&cache_lock);
-    }
+  cache_count_access (c);
+  memset (c->buffer, 0, BLOCK_SECTOR_SIZE);
+  c->loaded = 1;
+  cache_touch (c, true);
+  return c;
+}
+
+/* Returns the BLOCK_SECTOR_SIZE-byte buffer of pinned entry C. */
+void *
+cache_buffer (struct cache_entry *c)
+{
+  ASSERT (lock_held_by_current_thread (&c->lock));
+  return c->buffer;
+}
+
+/* Releases the pin on C.  DIRTY must be true if the buffer was
+   modified, which is logged in the journal as a metadata
+   update. */
+void
+cache_unpin (struct cache_entry *c, bool dirty)
+{
+  if (dirty)
+    cache_log (c);
+  lock_release (&c->lock);
+}
 
-    lock_release (&cache[next].lock);
+/* Asks the read-ahead thread to bring SECTOR into the cache.
+   Returns immediately; does nothing if SECTOR is already cached
+   or too many requests are pending. */
+void
+cache_prefetch (block_sector_t sector)
+{
+  if (cache_contains (sector))
+    return;
+
+  lock_acquire (&read_lock);
+  if (read_head - read_tail < READ_QUEUE_SIZE)
+  {
+    read_queue[read_head++ % READ_QUEUE_SIZE] = sector;
+    sema_up (&read_sema);
   }
+  else
+    cache_count (&stats.ra_dropped);
+  lock_release (&read_lock);
+}
+
+static int
+compare_flush_entries (const void *a_, const void *b_)
+{
+  const struct flush_entry *a = a_;
+  const struct flush_entry *b = b_;
+
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
 }
 
+/* Writes every dirty cache entry back in a single pass: logged
+   metadata to the journal, everything else to disk.  Entries that
+   are not in use are written asynchronously, all at once in
+   ascending sector order, so that the disk driver can merge
+   adjacent sectors; the rest are written one by one afterward. */
 void
-cache_done (void)
+cache_flush (void)
 {
-  lock_acquire (&cache_lock);
-  for (int i = 0; i < 64; i++)
+  struct semaphore done;
+  size_t cnt = 0;
+  size_t in_flight = 0;
+
+  lock_acquire (&flush_lock);
+  sema_init (&done, 0);
+
+  /* Snapshot the dirty sectors without taking any entry locks;
+     anything that changes meanwhile is rechecked below. */
+  for (size_t i = 0; i < cache_sector_cnt; i++)
+    if (cache[i].dirty)
+    {
+      flush_list[cnt].sector = cache[i].sector;
+      flush_list[cnt].cache_entry = &cache[i];
+      flush_list[cnt].submitted = false;
+      cnt++;
+    }
+  qsort (flush_list, cnt, sizeof *flush_list, compare_flush_entries);
+
+  /* Holding several entry locks at once is safe only because we
+     never wait for one while holding another: busy entries are
+     skipped here and written below, after the locks taken here
+     have been released. */
+  for (size_t i = 0; i < cnt; i++)
+  {
+    struct flush_entry *f = &flush_list[i];
+    struct cache_entry *c = f->cache_entry;
+
+    if (!lock_try_acquire (&c->lock))
+      continue;
+    if (c->valid && c->loaded && c->logged && c->sector == f->sector)
+    {
+      cache_clean (c);
+      lock_release (&c->lock);
+      f->cache_entry = NULL;
+    }
+    else if (c->valid && c->loaded && c->dirty && c->sector == f->sector)
+    {
+      cache_submit (c, &f->request, true, &done);
+      f->submitted = true;
+      in_flight++;
+    }
+    else
+    {
+      lock_release (&c->lock);
+      f->cache_entry = NULL;
+    }
+  }
+
+  while (in_flight-- > 0)
+    sema_down (&done);
+
+  for (size_t i = 0; i < cnt; i++)
+  {
+    struct flush_entry *f = &flush_list[i];
+
+    if (f->submitted)
+    {
+      cache_cleaned (f->cache_entry);
+      lock_release (&f->cache_entry->lock);
+      f->cache_entry = NULL;
+    }
+  }
+
+  /* Now that we hold no entry lock, wait for the busy entries one
+     at a time. */
+  for (size_t i = 0; i < cnt; i++)
   {
-    if (cache[i].dirty && cache[i].loaded && cache[i].valid)
+    struct flush_entry *f = &flush_list[i];
+    struct cache_entry *c = f->cache_entry;
+
+    if (c != NULL)
     {
-      block_write (fs_device, cache[i].sector, cache[i].buffer);
-      cache[i].dirty = false;
+      lock_acquire (&c->lock);
+      if (c->valid && c->loaded && c->sector == f->sector)
+        cache_clean (c);
+      lock_release (&c->lock);
     }
   }
-  lock_release(&cache_lock);
+
+  lock_release (&flush_lock);
+}
+
+void
+cache_done (void)
+{
+  cache_flush ();
 }
 
+/* Copies the current buffer cache statistics into *STATSP. */
+void
+cache_get_stats (struct cache_stats *statsp)
+{
+  enum intr_level old_level = intr_disable ();
+  *statsp = stats;
+  intr_set_level (old_level);
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  struct cache_stats s;
+
+  cache_get_stats (&s);
+  printf ("Cache: %llu hits, %llu misses, %llu evictions, "
+          "%llu write-backs (%llu on eviction)\n",
+          s.hits, s.misses, s.evictions, s.write_backs, s.evict_writes);
+  printf ("Cache: %llu sectors read ahead, %llu used, %llu dropped\n",
+          s.ra_reads, s.ra_used, s.ra_dropped);
+  printf ("Cache: %llu lock waits, %lld ticks waiting\n",
+          s.lock_waits, s.lock_wait_ticks);
+}
+
+/* Drops SECTOR, which has just been freed, from the cache and
+   the journal without writing it back.  Until the freeing
+   transaction commits, the disk may still use its old
+   contents. */
 void
 cache_remove (block_sector_t sector)
 {
-  lock_acquire (&cache_lock);
+  struct cache_shard *s = sector_to_shard (sector);
+  struct cache_entry *c;
+
+  lock_acquire (&s->lock);
+  c = cache_lookup (s, sector);
+  lock_release (&s->lock);
+  if (c == NULL)
+  {
+    journal_forget (sector);
+    return;
+  }
 
-  for (int i = 0; i < 64; i++)
+  lock_acquire (&c->lock);
+  if (c->valid && c->sector == sector && c->loaded)
   {
-    if (cache[i].sector == sector && cache[i].valid && cache[i].loaded)
+    if (c->dirty)
     {
-      memset (cache[i].buffer, 0, BLOCK_SECTOR_SIZE);
-      block_write (fs_device, cache[i].sector, cache[i].buffer);
-      cache[i].valid = false;
-      cache[i].loaded = false;
-      cache[i].dirty = false;
-      lock_release (&cache_lock);
-      return;
+      enum intr_level old_level = intr_disable ();
+      c->dirty = 0;
+      dirty_cnt--;
+      intr_set_level (old_level);
     }
-  }
+    c->logged = false;
 
-  lock_release (&cache_lock);
+    lock_acquire (&s->lock);
+    cache_unqueue (s, c);
+    hash_delete (&s->map, &c->hash_elem);
+    c->valid = false;
+    c->loaded = false;
+    list_push_back (&s->free_entries, &c->queue_elem);
+    lock_release (&s->lock);
+  }
+  lock_release (&c->lock);
+  journal_forget (sector);
 }
 
 
 
+/* Read-ahead thread.  Loads the sectors queued by
+   cache_prefetch(), doing any eviction they require here rather
+   than in the thread that asked for them.  Up to READ_BATCH_SIZE
+   sectors are read at once, so that the disk driver can order
+   and merge them. */
 void
 read_ahead (void *aux UNUSED)
 {
+  static struct cache_entry *entries[READ_BATCH_SIZE];
+  static struct block_request requests[READ_BATCH_SIZE];
+  struct semaphore done;
+
+  sema_init (&done, 0);
   while (true)
   {
-    if (list_empty (&read_queue))
-      sema_down (&read_sema);
-
+    size_t sector_cnt = 0;
+    size_t cnt = 0;
 
-    while (!list_empty (&read_queue))
+    sema_down (&read_sema);
+    do
     {
-      lock_acquire (&cache_lock);
-      struct list_elem *e = list_pop_front (&read_queue);
-      lock_release (&cache_lock);
+      block_sector_t sector;
+      struct cache_entry *c;
 
-      struct queue_entry *queue_entry = list_entry (e, struct queue_entry, elem);
-      int index = queue_entry->index;
+      lock_acquire (&read_lock);
+      sector = read_queue[read_tail++ % READ_QUEUE_SIZE];
+      lock_release (&read_lock);
 
-      lock_acquire (&cache[index].lock);
-      if (!cache[index].loaded)
-        cache_load (&cache[index]);
-      lock_release (&cache[index].lock);
+      /* A sector cached since it was queued needs no read. */
+      if (cache_contains (sector))
+        continue;
 
-      free (queue_entry);
+      /* We hold other entries' locks, so we must not wait for
+         theirs, nor for an eviction that may need one of ours to
+         be released.  End the batch instead, dropping SECTOR,
+         which is only a hint. */
+      c = cache_get (sector, false, false);
+      if (c == NULL)
+        break;
+      if (journal_read (sector, c->buffer))
+      {
+        c->loaded = 1;
+        lock_release (&c->lock);
+        continue;
+      }
+      cache_submit (c, &requests[cnt], false, &done);
+      entries[cnt++] = c;
+    }
+    while (++sector_cnt < READ_BATCH_SIZE && sema_try_down (&read_sema));
+
+    for (size_t i = 0; i < cnt; i++)
+      sema_down (&done);
+    for (size_t i = 0; i < cnt; i++)
+    {
+      struct cache_entry *c = entries[i];
 
-      // block_read (fs_device, cache[index].sector, &cache[index].buffer);
-      // lock_release (&cache[index].lock);
+      c->loaded = 1;
+      c->prefetched = true;
+      cache_count (&stats.ra_reads);
+      lock_release (&c->lock);
     }
   }
 }
 
+/* Write-back daemon.  Flushes the cache whenever woken, either
+   by flush_timer() or because too many entries are dirty, then
+   has the journal commit what the flush saved. */
 void
 write_back (void *aux UNUSED)
 {
   while (1)
   {
-    thread_sleep (1000);
-    for (int i = 0; i < 64; i++)
-    {
-      lock_acquire (&cache[i].lock);
-      if (cache[i].dirty && cache[i].valid)
-      {
-        block_write (fs_device, cache[i].sector, cache[i].buffer);
-        cache[i].dirty = 0;
-      }
-      lock_release (&cache[i].lock);
-    }
+    sema_down (&flush_sema);
+    flush_pending = false;
+    cache_flush ();
+    journal_wake ();
+  }
+}
+
+/* Wakes the write-back daemon every cache_flush_ms milliseconds. */
+void
+flush_timer (void *aux UNUSED)
+{
+  while (1)
+  {
+    timer_msleep (cache_flush_ms);
+    cache_wake_flusher ();
   }
 }
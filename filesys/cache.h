@@ -1,5 +1,58 @@
-void cache_read_at (block_sector_t, void *, int, int);
-void cache_write_at (block_sector_t, const void *, int, int);
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/block.h"
+
+struct cache_entry;
+
+/* Default number of sectors held by the buffer cache. */
+#define CACHE_DEFAULT_SECTORS 64
+
+/* Default interval between write-back passes, in milliseconds. */
+#define CACHE_DEFAULT_FLUSH_MS 1000
+
+/* Number of sectors held by the buffer cache.
+   Controlled by kernel command-line option "-cache-sectors=N". */
+extern size_t cache_sector_cnt;
+
+/* Milliseconds between periodic write-back passes, or 0 to flush
+   only when the cache gets too dirty.
+   Controlled by kernel command-line option "-cache-flush=MS". */
+extern unsigned cache_flush_ms;
+
+/* Buffer cache statistics. */
+struct cache_stats
+  {
+    unsigned long long hits;            /* Accesses to a cached sector. */
+    unsigned long long misses;          /* Accesses that had to load. */
+    unsigned long long evictions;       /* Sectors evicted. */
+    unsigned long long write_backs;     /* Dirty sectors written to disk. */
+    unsigned long long evict_writes;    /* ...of which forced by eviction. */
+    unsigned long long ra_reads;        /* Sectors loaded by read-ahead. */
+    unsigned long long ra_used;         /* ...of which later accessed. */
+    unsigned long long ra_dropped;      /* Read-ahead requests dropped. */
+    unsigned long long lock_waits;      /* Contended lock acquisitions. */
+    int64_t lock_wait_ticks;            /* Timer ticks spent waiting. */
+  };
+
+void cache_read_at (block_sector_t, void *, int, int, bool meta);
+void cache_write_at (block_sector_t, const void *, int, int, bool meta);
+void cache_prefetch (block_sector_t);
+
+/* In-place access to cached sectors. */
+struct cache_entry *cache_pin (block_sector_t);
+struct cache_entry *cache_pin_zeroed (block_sector_t);
+void *cache_buffer (struct cache_entry *);
+void cache_unpin (struct cache_entry *, bool dirty);
+
 void cache_init (void);
 void cache_done (void);
+void cache_flush (void);
 void cache_remove (block_sector_t);
+void cache_get_stats (struct cache_stats *);
+void cache_print_stats (void);
+
+#endif /* filesys/cache.h */
@@ -0,0 +1,168 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* The directory entry cache remembers the outcome of recent
+   directory lookups, keyed by the sector of the directory's inode
+   and the name looked up, so that resolving the same path again
+   does not search any directory.  A lookup that found nothing is
+   remembered too, as a negative entry, since programs often probe
+   for files that do not exist.
+
+   Entries are kept current by the directory code, which updates
+   them while holding the directory's lock whenever it adds or
+   removes a name.  When the cache is full, the least recently
+   used entry is replaced. */
+
+/* A cached name. */
+struct dcache_entry
+  {
+    struct hash_elem hash_elem;         /* Element in map. */
+    struct list_elem lru_elem;          /* Element in lru. */
+    block_sector_t dir;                 /* Directory inode's sector. */
+    char name[NAME_MAX + 1];            /* Name within DIR. */
+    block_sector_t sector;              /* Inode's sector, or 0 if
+                                           DIR has no such name. */
+  };
+
+static struct lock dcache_lock;         /* Protects everything below. */
+static struct hash map;                 /* Entries in use. */
+static struct list lru;                 /* Entries in use, most
+                                           recently used first. */
+static struct list free_entries;        /* Entries not in use. */
+static struct dcache_entry *entries;    /* DCACHE_SIZE entries. */
+
+static hash_hash_func dcache_hash;
+static hash_less_func dcache_less;
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void)
+{
+  lock_init (&dcache_lock);
+  entries = calloc (DCACHE_SIZE, sizeof *entries);
+  if (entries == NULL || !hash_init (&map, dcache_hash, dcache_less, NULL))
+    PANIC ("directory entry cache allocation failed");
+  list_init (&lru);
+  list_init (&free_entries);
+  for (size_t i = 0; i < DCACHE_SIZE; i++)
+    list_push_back (&free_entries, &entries[i].lru_elem);
+}
+
+static unsigned
+dcache_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dcache_entry *d = hash_entry (e, struct dcache_entry,
+                                             hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+static bool
+dcache_less (const struct hash_elem *a, const struct hash_elem *b,
+             void *aux UNUSED)
+{
+  const struct dcache_entry *d_a = hash_entry (a, struct dcache_entry,
+                                               hash_elem);
+  const struct dcache_entry *d_b = hash_entry (b, struct dcache_entry,
+                                               hash_elem);
+  if (d_a->dir != d_b->dir)
+    return d_a->dir < d_b->dir;
+  return strcmp (d_a->name, d_b->name) < 0;
+}
+
+/* Returns the entry for NAME in DIR, or a null pointer if there is
+   none.  dcache_lock must be held. */
+static struct dcache_entry *
+find (block_sector_t dir, const char *name)
+{
+  struct dcache_entry key;
+  struct hash_elem *e;
+
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dcache_entry, hash_elem) : NULL;
+}
+
+/* Removes D from the cache.  dcache_lock must be held. */
+static void
+discard (struct dcache_entry *d)
+{
+  hash_delete (&map, &d->hash_elem);
+  list_remove (&d->lru_elem);
+  list_push_back (&free_entries, &d->lru_elem);
+}
+
+/* Looks up NAME in the directory whose inode is in sector DIR.
+   If the outcome is cached, returns true and stores the sector of
+   NAME's inode in *SECTORP, or 0 if DIR has no such name.
+   Otherwise returns false. */
+bool
+dcache_lookup (block_sector_t dir, const char *name, block_sector_t *sectorp)
+{
+  struct dcache_entry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return false;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+  {
+    *sectorp = d->sector;
+    list_remove (&d->lru_elem);
+    list_push_front (&lru, &d->lru_elem);
+  }
+  lock_release (&dcache_lock);
+
+  return d != NULL;
+}
+
+/* Records that NAME in the directory whose inode is in sector DIR
+   refers to the inode in SECTOR, or that there is no such name if
+   SECTOR is 0.  The caller must hold the directory's lock, so that
+   the record cannot overtake a change to the directory. */
+void
+dcache_insert (block_sector_t dir, const char *name, block_sector_t sector)
+{
+  struct dcache_entry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d == NULL)
+  {
+    if (list_empty (&free_entries))
+      discard (list_entry (list_back (&lru), struct dcache_entry, lru_elem));
+    d = list_entry (list_pop_front (&free_entries), struct dcache_entry,
+                    lru_elem);
+    d->dir = dir;
+    strlcpy (d->name, name, sizeof d->name);
+    hash_insert (&map, &d->hash_elem);
+  }
+  else
+    list_remove (&d->lru_elem);
+  d->sector = sector;
+  list_push_front (&lru, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every name in the directory whose inode is in sector
+   DIR, which is being deleted, so that nothing stale is found if
+   the sector is reused. */
+void
+dcache_purge (block_sector_t dir)
+{
+  lock_acquire (&dcache_lock);
+  for (size_t i = 0; i < DCACHE_SIZE; i++)
+    if (entries[i].dir == dir && find (dir, entries[i].name) == &entries[i])
+      discard (&entries[i]);
+  lock_release (&dcache_lock);
+}
@@ -1,17 +1,112 @@
 #include "filesys/directory.h"
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <list.h>
+#include <hash.h>
+#include <round.h>
 #include "filesys/filesys.h"
+#include "filesys/dcache.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 #include "threads/thread.h"
 
+/* A directory starts out as a flat array of dir_entries that is
+   searched linearly.  Once it has DIR_LEAF_CNT entries and no free
+   slot, it is converted to a hashed index in the style of ext3's
+   htree, so that a lookup reads at most three blocks plus any
+   overflow leaves, however large the directory grows.
+
+   In an indexed directory, block 0 is a dir_root, which maps
+   ranges of name hashes to leaf blocks, directly or through one
+   level of dir_nodes.  Each dir_leaf holds the entries whose names
+   hash into its range.  A full leaf is split in two at a hash
+   boundary, so entries with equal hashes always share a leaf
+   chain; a leaf that cannot be split, because its entries all
+   have the same hash or the index is full, grows a chain of
+   overflow leaves instead.  Entries are never moved once placed
+   except by a split, so a dir_entry's offset stays valid while
+   the directory is locked.
+
+   The root begins with what a linear directory would take for a
+   free entry whose inode_sector is DIR_INDEX_MAGIC.  A linear
+   directory always begins with its "." entry, which is in use. */
+#define DIR_INDEX_MAGIC 0x58444e49      /* "INDX". */
+#define DIR_LEAF_MAGIC 0x4641454c       /* "LEAF". */
+#define DIR_NODE_MAGIC 0x45444f4e       /* "NODE". */
+
+/* Maps names whose hash is HASH or greater, up to the next
+   dir_index's hash, to BLOCK. */
+struct dir_index
+  {
+    uint32_t hash;                      /* Least hash covered. */
+    uint32_t block;                     /* Block in directory. */
+  };
+
+/* Number of dir_indexes in a dir_root or a dir_node. */
+#define DIR_ROOT_CNT ((BLOCK_SECTOR_SIZE - sizeof (struct dir_entry) \
+                       - 2 * sizeof (uint16_t)) / sizeof (struct dir_index))
+#define DIR_NODE_CNT ((BLOCK_SECTOR_SIZE - 2 * sizeof (uint32_t)) \
+                      / sizeof (struct dir_index))
+
+/* Block 0 of an indexed directory. */
+struct dir_root
+  {
+    struct dir_entry marker;            /* Free, inode_sector is
+                                           DIR_INDEX_MAGIC. */
+    uint16_t cnt;                       /* Number of indexes. */
+    uint16_t depth;                     /* 1 if indexes point to
+                                           dir_nodes, 0 if to leaves. */
+    struct dir_index indexes[DIR_ROOT_CNT]; /* Sorted by hash. */
+  };
+
+/* An interior index block, pointing to leaves. */
+struct dir_node
+  {
+    uint32_t magic;                     /* DIR_NODE_MAGIC. */
+    uint32_t cnt;                       /* Number of indexes. */
+    struct dir_index indexes[DIR_NODE_CNT]; /* Sorted by hash. */
+  };
+
+/* Number of dir_entries in a dir_leaf. */
+#define DIR_LEAF_CNT ((BLOCK_SECTOR_SIZE - 2 * sizeof (uint32_t)) \
+                      / sizeof (struct dir_entry))
+
+/* A block of directory entries. */
+struct dir_leaf
+  {
+    uint32_t magic;                     /* DIR_LEAF_MAGIC. */
+    uint32_t next;                      /* Overflow leaf, or 0. */
+    struct dir_entry entries[DIR_LEAF_CNT];
+  };
+
+/* A directory block of any kind. */
+union dir_block
+  {
+    struct dir_root root;
+    struct dir_node node;
+    struct dir_leaf leaf;
+    uint8_t raw[BLOCK_SECTOR_SIZE];
+  };
+
+/* A dir_entry with its name's hash, for splitting leaves. */
+struct hashed_entry
+  {
+    uint32_t hash;
+    struct dir_entry e;
+  };
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt, struct dir *prevdir)
 {
+  /* If these assertions fail, an index block is not exactly one
+     sector in size, and you should fix that. */
+  ASSERT (sizeof (struct dir_root) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct dir_node) == BLOCK_SECTOR_SIZE);
+
   entry_cnt = entry_cnt > 2 ? entry_cnt : 2;
   bool success = inode_create (sector, entry_cnt * sizeof (struct dir_entry), true);
   if (success)
@@ -88,41 +183,418 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Returns the number of blocks in directory INODE. */
+static uint32_t
+block_cnt (struct inode *inode)
+{
+  return DIV_ROUND_UP (inode_length (inode), BLOCK_SECTOR_SIZE);
+}
+
+/* Reads block BLOCK of directory INODE into B.  Returns true if
+   successful, false if BLOCK is past the end of the directory. */
+static bool
+read_block (struct inode *inode, uint32_t block, union dir_block *b)
+{
+  return inode_read_at (inode, b, BLOCK_SECTOR_SIZE,
+                        block * BLOCK_SECTOR_SIZE) == BLOCK_SECTOR_SIZE;
+}
+
+/* Writes B to block BLOCK of directory INODE.  Returns true if
+   successful, false if the disk is full. */
+static bool
+write_block (struct inode *inode, uint32_t block, const union dir_block *b)
+{
+  return inode_write_at (inode, b, BLOCK_SECTOR_SIZE,
+                         block * BLOCK_SECTOR_SIZE) == BLOCK_SECTOR_SIZE;
+}
+
+/* Returns the byte offset of entry SLOT of leaf BLOCK. */
+static off_t
+leaf_entry_ofs (uint32_t block, size_t slot)
+{
+  return (block * BLOCK_SECTOR_SIZE + offsetof (struct dir_leaf, entries)
+          + slot * sizeof (struct dir_entry));
+}
+
+/* Returns true if directory INODE has a hashed index. */
+static bool
+is_indexed (struct inode *inode)
+{
+  struct dir_entry e;
+
+  return (inode_read_at (inode, &e, sizeof e, 0) == sizeof e
+          && !e.in_use && e.inode_sector == DIR_INDEX_MAGIC);
+}
+
+/* Returns the position of the last of the CNT INDEXES that covers
+   HASH.  The first index covers hash 0. */
+static size_t
+index_pos (const struct dir_index *indexes, size_t cnt, uint32_t hash)
+{
+  size_t lo = 0, hi = cnt;
+
+  /* Invariant: indexes[lo].hash <= HASH, and every index at or
+     after HI has a greater hash. */
+  while (hi - lo > 1)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (indexes[mid].hash <= hash)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Inserts INDEX into the CNT sorted INDEXES, which have room for
+   one more. */
+static void
+index_insert (struct dir_index *indexes, size_t cnt,
+              const struct dir_index *index)
+{
+  size_t pos = index_pos (indexes, cnt, index->hash) + 1;
+
+  memmove (indexes + pos + 1, indexes + pos,
+           (cnt - pos) * sizeof *indexes);
+  indexes[pos] = *index;
+}
+
+/* Returns the first leaf for HASH in indexed directory INODE, or
+   0 if the index is damaged, using B as scratch.  Stores the
+   dir_node that points to the leaf in *NODEP, or 0 if the root
+   points to it directly. */
+static uint32_t
+find_leaf (struct inode *inode, uint32_t hash, union dir_block *b,
+           uint32_t *nodep)
+{
+  uint32_t block;
+
+  *nodep = 0;
+  if (!read_block (inode, 0, b) || b->root.cnt == 0)
+    return 0;
+  block = b->root.indexes[index_pos (b->root.indexes, b->root.cnt, hash)].block;
+  if (b->root.depth > 0)
+  {
+    *nodep = block;
+    if (!read_block (inode, block, b) || b->node.magic != DIR_NODE_MAGIC
+        || b->node.cnt == 0)
+      return 0;
+    block = b->node.indexes[index_pos (b->node.indexes, b->node.cnt,
+                                       hash)].block;
+  }
+  return block;
+}
+
+/* Searches the leaves for NAME in indexed directory INODE, as for
+   lookup(). */
+static bool
+index_lookup (struct inode *inode, const char *name,
+              struct dir_entry *ep, off_t *ofsp)
+{
+  union dir_block *b = malloc (sizeof *b);
+  uint32_t node, block;
+  bool found = false;
+
+  if (b == NULL)
+    return false;
+
+  for (block = find_leaf (inode, hash_string (name), b, &node); block != 0;
+       block = b->leaf.next)
+  {
+    if (!read_block (inode, block, b) || b->leaf.magic != DIR_LEAF_MAGIC)
+      break;
+    for (size_t i = 0; i < DIR_LEAF_CNT; i++)
+    {
+      const struct dir_entry *e = &b->leaf.entries[i];
+      if (e->in_use && !strcmp (name, e->name))
+      {
+        if (ep != NULL)
+          *ep = *e;
+        if (ofsp != NULL)
+          *ofsp = leaf_entry_ofs (block, i);
+        found = true;
+        goto done;
+      }
+    }
+  }
+
+ done:
+  free (b);
+  return found;
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   otherwise, returns false and ignores EP and OFSP.
+   DIR's extension lock must be held. */
 static bool
-lookup (const struct dir *dir, const char *name,
-        struct dir_entry *ep, off_t *ofsp)
+find_entry (const struct dir *dir, const char *name,
+            struct dir_entry *ep, off_t *ofsp)
 {
   struct dir_entry e;
   size_t ofs;
 
-  ASSERT (dir != NULL);
-  ASSERT (name != NULL);
-
-  int i;
+  if (is_indexed (dir->inode))
+    return index_lookup (dir->inode, name, ep, ofsp);
 
-  acquire_extension_lock (dir->inode);
-
-  for (ofs = 0; (i = inode_read_at (dir->inode, &e, sizeof e, ofs)) == sizeof e;
+  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e)
-  {
     if (e.in_use && !strcmp (name, e.name))
       {
         if (ep != NULL)
           *ep = e;
         if (ofsp != NULL)
           *ofsp = ofs;
-        release_extension_lock (dir->inode);
         return true;
       }
+  return false;
+}
+
+static int
+compare_hashed_entries (const void *a_, const void *b_)
+{
+  const struct hashed_entry *a = a_;
+  const struct hashed_entry *b = b_;
+
+  return a->hash < b->hash ? -1 : a->hash > b->hash;
+}
+
+/* Makes room in the index of directory INODE for one more index
+   covering HASH, adding a dir_node or splitting one if need be.
+   Returns the block of the dir_node that is to receive it, or 0
+   for the root.  Returns -1 if the index is full or the disk
+   is. */
+static int64_t
+make_index_room (struct inode *inode, uint32_t hash, union dir_block *b,
+                 union dir_block *nb)
+{
+  struct dir_index index;
+  uint32_t node, new_node;
+  size_t half;
+
+  if (!read_block (inode, 0, b))
+    return -1;
+  if (b->root.depth == 0)
+  {
+    if (b->root.cnt < DIR_ROOT_CNT)
+      return 0;
+
+    /* Push the root's indexes down into a new node. */
+    new_node = block_cnt (inode);
+    memset (nb, 0, sizeof *nb);
+    nb->node.magic = DIR_NODE_MAGIC;
+    nb->node.cnt = b->root.cnt;
+    memcpy (nb->node.indexes, b->root.indexes,
+            b->root.cnt * sizeof *b->root.indexes);
+    if (!write_block (inode, new_node, nb))
+      return -1;
+    b->root.depth = 1;
+    b->root.cnt = 1;
+    b->root.indexes[0].hash = 0;
+    b->root.indexes[0].block = new_node;
+    return write_block (inode, 0, b) ? (int64_t) new_node : -1;
   }
 
-  release_extension_lock (dir->inode);
-  return false;
+  node = b->root.indexes[index_pos (b->root.indexes, b->root.cnt,
+                                    hash)].block;
+  if (!read_block (inode, node, nb) || nb->node.magic != DIR_NODE_MAGIC)
+    return -1;
+  if (nb->node.cnt < DIR_NODE_CNT)
+    return node;
+  if (b->root.cnt == DIR_ROOT_CNT)
+    return -1;
+
+  /* Split the node, moving its upper half into a new node. */
+  new_node = block_cnt (inode);
+  half = nb->node.cnt / 2;
+  index.hash = nb->node.indexes[half].hash;
+  index.block = new_node;
+  memmove (nb->node.indexes, nb->node.indexes + half,
+           (nb->node.cnt - half) * sizeof *nb->node.indexes);
+  nb->node.cnt -= half;
+  if (!write_block (inode, new_node, nb))
+    return -1;
+  if (!read_block (inode, node, nb))
+    return -1;
+  nb->node.cnt = half;
+  if (!write_block (inode, node, nb))
+    return -1;
+  index_insert (b->root.indexes, b->root.cnt++, &index);
+  if (!write_block (inode, 0, b))
+    return -1;
+  return hash >= index.hash ? new_node : node;
+}
+
+/* Splits full leaf BLOCK of directory INODE at a hash boundary,
+   moving its entries with greater hashes into a new leaf, and
+   indexes the new leaf.  HASH is the hash of the name that did
+   not fit, which selects the leaf among equal index hashes.
+   Returns true if successful, false if the leaf's entries all
+   have the same hash or the index or disk is full. */
+static bool
+split_leaf (struct inode *inode, uint32_t block, uint32_t hash)
+{
+  union dir_block *b = malloc (sizeof *b);
+  union dir_block *nb = malloc (sizeof *nb);
+  struct hashed_entry *entries = malloc (DIR_LEAF_CNT * sizeof *entries);
+  struct dir_index index;
+  size_t cnt = 0, mid;
+  int64_t node;
+  bool success = false;
+
+  if (b == NULL || nb == NULL || entries == NULL)
+    goto done;
+
+  /* Sort the leaf's entries by hash and choose the boundary
+     nearest the middle. */
+  if (!read_block (inode, block, b))
+    goto done;
+  for (size_t i = 0; i < DIR_LEAF_CNT; i++)
+    if (b->leaf.entries[i].in_use)
+    {
+      entries[cnt].hash = hash_string (b->leaf.entries[i].name);
+      entries[cnt++].e = b->leaf.entries[i];
+    }
+  qsort (entries, cnt, sizeof *entries, compare_hashed_entries);
+  for (mid = cnt / 2; mid < cnt; mid++)
+    if (mid > 0 && entries[mid - 1].hash != entries[mid].hash)
+      break;
+  if (mid == cnt)
+    for (mid = cnt / 2; mid > 0; mid--)
+      if (entries[mid - 1].hash != entries[mid].hash)
+        break;
+  if (mid == 0)
+    goto done;
+
+  node = make_index_room (inode, hash, nb, b);
+  if (node < 0)
+    goto done;
+
+  /* Write the new leaf before the index can point to it. */
+  index.hash = entries[mid].hash;
+  index.block = block_cnt (inode);
+  memset (b, 0, sizeof *b);
+  b->leaf.magic = DIR_LEAF_MAGIC;
+  for (size_t i = mid; i < cnt; i++)
+    b->leaf.entries[i - mid] = entries[i].e;
+  if (!write_block (inode, index.block, b))
+    goto done;
+
+  memset (b, 0, sizeof *b);
+  b->leaf.magic = DIR_LEAF_MAGIC;
+  for (size_t i = 0; i < mid; i++)
+    b->leaf.entries[i] = entries[i].e;
+  if (!write_block (inode, block, b))
+    goto done;
+
+  if (!read_block (inode, node, b))
+    goto done;
+  if (node == 0)
+    index_insert (b->root.indexes, b->root.cnt++, &index);
+  else
+    index_insert (b->node.indexes, b->node.cnt++, &index);
+  success = write_block (inode, node, b);
+
+ done:
+  free (entries);
+  free (nb);
+  free (b);
+  return success;
+}
+
+/* Adds E to indexed directory INODE.  Returns true if successful,
+   false if a disk or memory error occurs. */
+static bool
+index_add (struct inode *inode, const struct dir_entry *e)
+{
+  union dir_block *b = malloc (sizeof *b);
+  uint32_t hash = hash_string (e->name);
+  uint32_t node, first, block, last;
+  bool split = false;
+  bool success = false;
+
+  if (b == NULL)
+    return false;
+
+  for (;;)
+  {
+    /* Look for a free slot in the leaf and its overflow chain. */
+    first = last = find_leaf (inode, hash, b, &node);
+    for (block = first; block != 0; block = b->leaf.next)
+    {
+      if (!read_block (inode, block, b) || b->leaf.magic != DIR_LEAF_MAGIC)
+        goto done;
+      for (size_t i = 0; i < DIR_LEAF_CNT; i++)
+        if (!b->leaf.entries[i].in_use)
+        {
+          success = (inode_write_at (inode, e, sizeof *e,
+                                     leaf_entry_ofs (block, i))
+                     == sizeof *e);
+          goto done;
+        }
+      last = block;
+    }
+    if (last == 0 || split || last != first
+        || !split_leaf (inode, first, hash))
+      break;
+    split = true;
+  }
+
+  /* The leaf cannot be split.  Chain an overflow leaf to it. */
+  if (last == 0)
+    goto done;
+  block = block_cnt (inode);
+  memset (b, 0, sizeof *b);
+  b->leaf.magic = DIR_LEAF_MAGIC;
+  b->leaf.entries[0] = *e;
+  if (!write_block (inode, block, b) || !read_block (inode, last, b))
+    goto done;
+  b->leaf.next = block;
+  success = write_block (inode, last, b);
+
+ done:
+  free (b);
+  return success;
+}
+
+/* Converts linear directory INODE, which must be full, to a
+   hashed index whose one leaf takes over INODE's entries.
+   Returns true if successful, false if INODE has too many entries
+   for one leaf or a disk or memory error occurs. */
+static bool
+index_create (struct inode *inode)
+{
+  size_t cnt = inode_length (inode) / sizeof (struct dir_entry);
+  union dir_block *b;
+  bool success = false;
+
+  if (cnt > DIR_LEAF_CNT)
+    return false;
+  b = calloc (1, sizeof *b);
+  if (b == NULL)
+    return false;
+
+  /* Fill in the leaf before overwriting the entries. */
+  b->leaf.magic = DIR_LEAF_MAGIC;
+  if (inode_read_at (inode, b->leaf.entries, cnt * sizeof (struct dir_entry),
+                     0) != (off_t) (cnt * sizeof (struct dir_entry))
+      || !write_block (inode, 1, b))
+    goto done;
+
+  memset (b, 0, sizeof *b);
+  b->root.marker.in_use = false;
+  b->root.marker.inode_sector = DIR_INDEX_MAGIC;
+  b->root.cnt = 1;
+  b->root.depth = 0;
+  b->root.indexes[0].hash = 0;
+  b->root.indexes[0].block = 1;
+  success = write_block (inode, 0, b);
+
+ done:
+  free (b);
+  return success;
 }
 
 /* Searches DIR for a file with the given NAME
@@ -133,16 +605,26 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode)
 {
+  block_sector_t dir_sector, sector;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
+  dir_sector = inode_get_inumber (dir->inode);
+
+  /* Consult the directory entry cache first.  On a miss, search
+     the directory and cache the outcome before anyone can change
+     it. */
+  if (!dcache_lookup (dir_sector, name, &sector))
+  {
+    acquire_extension_lock (dir->inode);
+    sector = find_entry (dir, name, &e, NULL) ? e.inode_sector : 0;
+    dcache_insert (dir_sector, name, sector);
+    release_extension_lock (dir->inode);
+  }
 
+  *inode = sector != 0 ? inode_open (sector) : NULL;
   return *inode != NULL;
 }
 
@@ -155,8 +637,9 @@ dir_lookup (const struct dir *dir, const char *name,
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
-  struct dir_entry e;
-  off_t ofs;
+  struct dir_entry e, slot;
+  off_t ofs = 0;
+  bool indexed;
   bool success = false;
 
   ASSERT (dir != NULL);
@@ -166,40 +649,49 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
+  acquire_extension_lock (dir->inode);
+
   /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  if (find_entry (dir, name, NULL, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-
-  acquire_extension_lock (dir->inode);
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (!e.in_use)
-    {
-      break;
-    }
-  release_extension_lock (dir->inode);
-
-  /* Write slot. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
 
-  if (strcmp (name, ".") != 0 && strcmp (name, "..") != 0)
-    inode_entrycnt_inc (dir->inode);
+  indexed = is_indexed (dir->inode);
+  if (!indexed)
+  {
+    /* Set OFS to offset of free slot.
+       If there are no free slots, then it will be set to the
+       current end-of-file.
+
+       inode_read_at() will only return a short read at end of file.
+       Otherwise, we'd need to verify that we didn't get a short
+       read due to something intermittent such as low memory. */
+    for (ofs = 0; inode_read_at (dir->inode, &slot, sizeof slot, ofs) == sizeof slot;
+         ofs += sizeof slot)
+      if (!slot.in_use)
+        break;
+
+    /* A directory that would outgrow one leaf gets an index. */
+    if (ofs >= (off_t) (DIR_LEAF_CNT * sizeof slot))
+      indexed = index_create (dir->inode);
+  }
 
-  acquire_extension_lock (dir->inode);
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-  release_extension_lock (dir->inode);
+  /* Write slot. */
+  if (indexed)
+    success = index_add (dir->inode, &e);
+  else
+    success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+
+  if (success)
+    dcache_insert (inode_get_inumber (dir->inode), name, inode_sector);
+  if (success && strcmp (name, ".") != 0 && strcmp (name, "..") != 0)
+    inode_entrycnt_inc (dir->inode);
 
  done:
+  release_extension_lock (dir->inode);
   return success;
 }
 
@@ -220,31 +712,41 @@ dir_remove (struct dir *dir, const char *name)
   if (!strcmp (name, ".") || !strcmp (name, ".."))
     goto done;
 
-  /* Find directory entry. */
-  if (!lookup (dir, name, &e, &ofs))
-    goto done;
+  /* Hold DIR's extension lock from the search through the erase,
+     so that a concurrent dir_add() cannot split the leaf and move
+     the entry away from OFS. */
+  acquire_extension_lock (dir->inode);
 
-  if (e.inode_sector == ROOT_DIR_SECTOR)
+  /* Find directory entry. */
+  if (!find_entry (dir, name, &e, &ofs)
+      || e.inode_sector == ROOT_DIR_SECTOR)
+  {
+    release_extension_lock (dir->inode);
     goto done;
+  }
 
   /* Open inode. */
   inode = inode_open (e.inode_sector);
 
-  if (inode == NULL)
-    goto done;
-
-  if (inode_isdir (inode) && (inode_get_open_cnt (inode) > 1 || !inode_emptydir (inode)) )
+  if (inode == NULL
+      || (inode_isdir (inode)
+          && (inode_get_open_cnt (inode) > 1 || !inode_emptydir (inode))))
+  {
+    release_extension_lock (dir->inode);
     goto done;
+  }
 
   /* Erase directory entry. */
   e.in_use = false;
-  acquire_extension_lock (dir->inode);
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
   {
     release_extension_lock (dir->inode);
     goto done;
   }
+  dcache_insert (inode_get_inumber (dir->inode), name, 0);
   release_extension_lock (dir->inode);
+  if (inode_isdir (inode))
+    dcache_purge (e.inode_sector);
 
   /* Remove inode. */
   inode_remove (inode);
@@ -257,25 +759,112 @@ dir_remove (struct dir *dir, const char *name)
   return success;
 }
 
+/* Returns true if E names a file, rather than being free or being
+   "." or "..". */
+static bool
+is_listed (const struct dir_entry *e)
+{
+  return e->in_use && strcmp (e->name, ".") != 0 && strcmp (e->name, "..") != 0;
+}
+
+/* Reads up to CNT entries of directory INODE, other than "." and
+   "..", starting at byte offset *POSP, into ENTRIES.  Advances
+   *POSP past the entries read.  Returns the number of entries
+   read, which is less than CNT only at the end of the directory.
+   Reads a block's worth of entries at a time.
+
+   If ISDIR is non-null, also sets ISDIR[i] to whether ENTRIES[i]
+   names a directory.  This is done before INODE's lock is
+   released, since afterward the entry may be removed and its
+   inode's sector reused. */
+size_t
+dir_read_entries (struct inode *inode, off_t *posp, struct dir_entry *entries,
+                  bool *isdir, size_t cnt)
+{
+  union dir_block *b = NULL;
+  size_t n = 0;
+
+  acquire_extension_lock (inode);
+  if (!is_indexed (inode))
+  {
+    /* Read entries straight into ENTRIES, then squeeze out the
+       ones that are not listed. */
+    while (n < cnt)
+      {
+        off_t want = (cnt - n) * sizeof *entries;
+        size_t got;
+
+        if (want > BLOCK_SECTOR_SIZE)
+          want = BLOCK_SECTOR_SIZE - BLOCK_SECTOR_SIZE % sizeof *entries;
+        got = inode_read_at (inode, entries + n, want, *posp) / sizeof *entries;
+        if (got == 0)
+          break;
+        *posp += got * sizeof *entries;
+        for (size_t i = n; i < n + got; i++)
+          if (is_listed (&entries[i]))
+            entries[n++] = entries[i];
+      }
+    goto done;
+  }
+
+  /* Walk the leaves in block order, skipping the index. */
+  b = malloc (sizeof *b);
+  if (b == NULL)
+    goto done;
+  for (uint32_t block = *posp / BLOCK_SECTOR_SIZE;
+       n < cnt && block < block_cnt (inode); block++)
+  {
+    off_t ofs = *posp - block * BLOCK_SECTOR_SIZE;
+    size_t slot = 0;
+
+    *posp = (block + 1) * BLOCK_SECTOR_SIZE;
+    if (block == 0 || !read_block (inode, block, b)
+        || b->leaf.magic != DIR_LEAF_MAGIC)
+      continue;
+    if (ofs > (off_t) offsetof (struct dir_leaf, entries))
+      slot = DIV_ROUND_UP (ofs - offsetof (struct dir_leaf, entries),
+                           sizeof (struct dir_entry));
+    for (; slot < DIR_LEAF_CNT; slot++)
+      if (is_listed (&b->leaf.entries[slot]))
+      {
+        if (n == cnt)
+        {
+          *posp = leaf_entry_ofs (block, slot);
+          break;
+        }
+        entries[n++] = b->leaf.entries[slot];
+      }
+  }
+
+ done:
+  if (isdir != NULL)
+    for (size_t i = 0; i < n; i++)
+      isdir[i] = inode_sector_isdir (entries[i].inode_sector);
+  release_extension_lock (inode);
+  free (b);
+  return n;
+}
+
+/* Reads the next directory entry of directory INODE at or after
+   byte offset *POSP, other than "." and "..", and stores its name
+   in NAME.  Advances *POSP past the entry.  Returns true if
+   successful, false if the directory contains no more entries. */
+bool
+dir_read_next (struct inode *inode, off_t *posp, char name[NAME_MAX + 1])
+{
+  struct dir_entry e;
+
+  if (dir_read_entries (inode, posp, &e, NULL, 1) == 0)
+    return false;
+  strlcpy (name, e.name, NAME_MAX + 1);
+  return true;
+}
+
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
    contains no more entries. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
-  struct dir_entry e;
-
-  acquire_extension_lock (dir->inode);
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e)
-    {
-      dir->pos += sizeof e;
-      if (e.in_use && strcmp (e.name, ".") != 0 && strcmp (e.name, "..") != 0)
-        {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          release_extension_lock (dir->inode);
-          return true;
-        }
-    }
-  release_extension_lock (dir->inode);
-  return false;
+  return dir_read_next (dir->inode, &dir->pos, name);
 }
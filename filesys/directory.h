@@ -42,5 +42,8 @@ bool dir_lookup (const struct dir *, const char *name, struct inode **);
 bool dir_add (struct dir *, const char *name, block_sector_t);
 bool dir_remove (struct dir *, const char *name);
 bool dir_readdir (struct dir *, char name[NAME_MAX + 1]);
+bool dir_read_next (struct inode *, off_t *pos, char name[NAME_MAX + 1]);
+size_t dir_read_entries (struct inode *, off_t *pos, struct dir_entry *,
+                         bool *isdir, size_t cnt);
 
 #endif /* filesys/directory.h */
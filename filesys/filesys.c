@@ -7,6 +7,8 @@
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "filesys/cache.h"
+#include "filesys/dcache.h"
+#include "filesys/journal.h"
 #include "threads/thread.h"
 
 /* Partition that contains the file system. */
@@ -26,9 +28,19 @@ filesys_init (bool format)
   inode_init ();
   free_map_init ();
   cache_init ();
+  dcache_init ();
+  journal_init (format);
 
   if (format)
     do_format ();
+  else
+  {
+    /* inode_open() fails on an inode in an older format. */
+    struct inode *root = inode_open (ROOT_DIR_SECTOR);
+    if (root == NULL)
+      PANIC ("unsupported on-disk format (reformat with -f)");
+    inode_close (root);
+  }
 
   free_map_open ();
 
@@ -41,8 +53,10 @@ void
 filesys_done (void)
 {
   inode_done ();
-  cache_done ();
   free_map_close ();
+  journal_done ();
+  cache_done ();
+  cache_print_stats ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -54,12 +68,14 @@ filesys_create (const char *name, off_t initial_size, struct dir *dir)
 {
   block_sector_t inode_sector = 0;
 
+  journal_begin ();
   bool success = (dir != NULL
                   && free_map_allocate (&inode_sector)
                   && inode_create (inode_sector, initial_size, false)
                   && dir_add (dir, name, inode_sector));
   if (!success && inode_sector != 0)
-    free_map_release (inode_sector);
+    free_map_release (inode_sector, 1);
+  journal_end ();
   //dir_close (dir);
 
   return success;
@@ -89,7 +105,10 @@ filesys_open (const char *name, struct dir *dir)
 bool
 filesys_remove (const char *name, struct dir *dir)
 {
+  /* The final close of the removed file may free its blocks. */
+  journal_begin_large ();
   bool success = dir != NULL && dir_remove (dir, name);
+  journal_end ();
   //dir_close (dir);
 
   return success;
@@ -100,9 +119,11 @@ static void
 do_format (void)
 {
   printf ("Formatting file system...");
+  journal_begin_large ();
   free_map_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 0, NULL))
     PANIC ("root directory creation failed");
   free_map_close ();
+  journal_end ();
   printf ("done.\n");
 }
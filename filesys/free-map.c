@@ -1,52 +1,167 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *held;          /* Sectors freed since the last
+                                        journal commit. */
+static struct lock free_map_lock;    /* Protects free_map, held,
+                                        next_fit. */
+static block_sector_t next_fit;      /* Where the next search begins. */
 
 /* Initializes the free map. */
 void
 free_map_init (void)
 {
   free_map = bitmap_create (block_size (fs_device));
-  if (free_map == NULL)
+  held = bitmap_create (block_size (fs_device));
+  if (free_map == NULL || held == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  lock_init (&free_map_lock);
+  next_fit = 0;
 }
 
-/* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
-   Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
-bool
-free_map_allocate (block_sector_t *sectorp)
+/* Returns the number of free sectors, up to CNT, in the run
+   starting at SECTOR. */
+static size_t
+free_run_length (block_sector_t sector, size_t cnt)
+{
+  size_t n;
+
+  for (n = 0; n < cnt && sector + n < bitmap_size (free_map); n++)
+    if (bitmap_test (free_map, sector + n) || bitmap_test (held, sector + n))
+      break;
+  return n;
+}
+
+/* Returns the first sector of a run of CNT free sectors at or
+   after START, or BITMAP_ERROR if there is none. */
+static size_t
+free_map_scan (size_t start, size_t cnt)
+{
+  for (;;)
+  {
+    size_t sector = bitmap_scan (free_map, start, cnt, false);
+
+    if (sector == BITMAP_ERROR || bitmap_none (held, sector, cnt))
+      return sector;
+    start = sector + 1;
+  }
+}
+
+/* Allocates between 1 and CNT consecutive sectors and stores the
+   first into *SECTORP.  Returns the number allocated, or 0 if the
+   disk is full or the free_map file could not be written.
+
+   Allocates at GOAL, if it is free, so that a growing file stays
+   contiguous; pass 0 for no preference.  Otherwise takes the
+   first run of CNT free sectors at or after the point where the
+   previous allocation ended, wrapping around to the start of the
+   disk, or failing that, as long a run as is free at the first
+   free sector found that way. */
+size_t
+free_map_allocate_run (block_sector_t goal, size_t cnt,
+                       block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, 1, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  size_t sector = BITMAP_ERROR;
+  size_t n = 0;
+
+  ASSERT (cnt > 0);
+
+  lock_acquire (&free_map_lock);
+  if (goal != 0 && goal < bitmap_size (free_map))
+  {
+    n = free_run_length (goal, cnt);
+    if (n > 0)
+      sector = goal;
+  }
+  if (sector == BITMAP_ERROR)
+  {
+    sector = free_map_scan (next_fit, cnt);
+    if (sector == BITMAP_ERROR)
+      sector = free_map_scan (0, cnt);
+    if (sector != BITMAP_ERROR)
+      n = cnt;
+  }
+  if (sector == BITMAP_ERROR)
+  {
+    sector = free_map_scan (next_fit, 1);
+    if (sector == BITMAP_ERROR)
+      sector = free_map_scan (0, 1);
+    if (sector != BITMAP_ERROR)
+      n = free_run_length (sector, cnt);
+  }
+
+  if (sector != BITMAP_ERROR)
+  {
+    bitmap_set_multiple (free_map, sector, n, true);
+    if (free_map_file != NULL
+        && !bitmap_write_range (free_map, free_map_file, sector, n))
     {
-      bitmap_set_multiple (free_map, sector, 1, false);
+      bitmap_set_multiple (free_map, sector, n, false);
       sector = BITMAP_ERROR;
     }
+  }
   if (sector != BITMAP_ERROR)
+  {
+    next_fit = sector + n;
     *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  }
+  else
+    n = 0;
+  lock_release (&free_map_lock);
+
+  return n;
+}
+
+/* Allocates a sector from the free map and stores it into
+   *SECTORP.
+   Returns true if successful, false if the disk is full or if
+   the free_map file could not be written. */
+bool
+free_map_allocate (block_sector_t *sectorp)
+{
+  return free_map_allocate_run (0, 1, sectorp) == 1;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Makes CNT sectors starting at SECTOR available for use once
+   the journal commits the transaction freeing them. */
 void
-free_map_release (block_sector_t sector)
+free_map_release (block_sector_t sector, size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (bitmap_all (free_map, sector, cnt));
+  bitmap_set_multiple (free_map, sector, cnt, false);
+  bitmap_set_multiple (held, sector, cnt, true);
+  bitmap_write_range (free_map, free_map_file, sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Makes the sectors released before the journal's latest commit
+   available for use. */
+void
+free_map_commit (void)
+{
+  lock_acquire (&free_map_lock);
+  bitmap_set_all (held, false);
+  lock_release (&free_map_lock);
+}
+
+/* Returns the number of sectors in the free map file. */
+size_t
+free_map_sectors (void)
 {
-  ASSERT (bitmap_all (free_map, sector, 1));
-  bitmap_set_multiple (free_map, sector, 1, false);
-  bitmap_write (free_map, free_map_file);
+  return DIV_ROUND_UP (bitmap_file_size (free_map), BLOCK_SECTOR_SIZE);
 }
 
 /* Opens the free map file and reads it from disk. */
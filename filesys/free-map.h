@@ -12,6 +12,10 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (block_sector_t *);
-void free_map_release (block_sector_t);
+size_t free_map_allocate_run (block_sector_t goal, size_t cnt,
+                              block_sector_t *);
+void free_map_release (block_sector_t, size_t cnt);
+void free_map_commit (void);
+size_t free_map_sectors (void);
 
 #endif /* filesys/free-map.h */
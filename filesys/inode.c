@@ -1,11 +1,12 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <stdio.h>
 #include <round.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 #include "filesys/cache.h"
 #include "threads/synch.h"
@@ -13,33 +14,81 @@
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
-#define NUM_DIRECT 10
-#define NUM_INDIRECT 1
-#define NUM_DOUBLE_INDIRECT 1
-#define NUM_SECTORS 16522
+/* On-disk inode format version.  Version 2 maps blocks with an
+   extent tree; version 1, with direct and indirect block
+   pointers, is no longer supported. */
+#define INODE_VERSION 2
+
+/* Bounds of the read-ahead window, in blocks.  The window starts
+   at RA_MIN_WINDOW when a sequential read is detected and doubles
+   on each further sequential read. */
+#define RA_MIN_WINDOW 2
+#define RA_MAX_WINDOW 64
+
+/* Number of extents each open inode keeps in memory. */
+#define INODE_MAP_CNT 8
+
+/* Most blocks of file data an open inode holds back from the disk
+   while their sectors are yet to be allocated. */
+#define INODE_DELAY_CNT 32
+
+/* A file's blocks are mapped by an extent tree whose root lives
+   in the inode.  Each leaf entry is an extent, a run of file
+   blocks stored in consecutive sectors.  Each interior entry
+   gives the first file block covered by a child node, so the
+   entries of every node are sorted by file block.  The root holds
+   about 40 extents, enough for most files to be mapped without
+   reading any other sector.  When the root fills up, its entries
+   move into a new node and the root becomes an interior node;
+   other full nodes split in two. */
+
+/* A run of LEN blocks of a file, starting at file block BLOCK,
+   stored in consecutive sectors starting at START. */
+struct extent
+  {
+    uint32_t block;                     /* First file block. */
+    uint32_t len;                       /* Number of blocks. */
+    block_sector_t start;               /* First sector. */
+  };
+
+/* An interior extent tree entry. */
+struct extent_index
+  {
+    uint32_t block;                     /* First file block under CHILD. */
+    block_sector_t child;               /* Sector of child node. */
+  };
+
+/* Header of an extent tree node. */
+struct extent_header
+  {
+    uint16_t cnt;                       /* Number of entries. */
+    uint16_t depth;                     /* Levels below, 0 in a leaf. */
+  };
+
+/* An extent tree node other than the root.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+#define NODE_BYTES (BLOCK_SECTOR_SIZE - sizeof (struct extent_header))
+struct extent_node
+  {
+    struct extent_header header;
+    uint8_t entries[NODE_BYTES];        /* Extents or extent_indexes. */
+  };
 
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+#define ROOT_BYTES 488
 struct inode_disk
   {
     off_t length;                       /* File size in bytes. */
-    block_sector_t direct[NUM_DIRECT];
-    block_sector_t indirect[NUM_INDIRECT];
-    block_sector_t double_indirect[NUM_DOUBLE_INDIRECT];
-
     bool isdir;                        /* Is directory? */
     int entry_cnt;                      /* Number of entries in directory */
-
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[112];               /* Not used. */
-  };
+    uint32_t version;                   /* INODE_VERSION. */
 
-struct indirect_block
-  {
-    block_sector_t indirect_blocks[128];
+    struct extent_header root;          /* Root of extent tree. */
+    uint8_t root_entries[ROOT_BYTES];   /* Extents or extent_indexes. */
   };
 
-static struct lock inode_lock;
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
 static inline size_t
@@ -51,282 +100,735 @@ bytes_to_sectors (off_t size)
 /* In-memory inode. */
 struct inode
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool busy;                          /* Being read in or written out? */
+    struct condition ready;             /* Signaled when BUSY clears. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     off_t length;                       /* File size in bytes. */
     bool isdir;                        /* Is directory? */
     int entry_cnt;                      /* Number of entries in directory */
+    bool dirty;                         /* LENGTH or ENTRY_CNT not yet
+                                           copied to the disk inode? */
     struct lock extension_lock;
     //struct inode_disk data;             /* Inode content. */
+
+    /* Sequential read detection. */
+    size_t ra_next;                     /* Next block if reads are sequential. */
+    size_t ra_window;                   /* Read-ahead window, 0 if random. */
+    size_t ra_end;                      /* Blocks below this are prefetched. */
+
+    /* Extents most recently used to map blocks, so that repeated
+       accesses need not read the extent tree.  Unused entries
+       have zero length. */
+    struct lock map_lock;               /* Protects map, map_next. */
+    struct extent map[INODE_MAP_CNT];
+    size_t map_next;                    /* Next entry to replace. */
+
+    /* Blocks written to a regular file where it has no sectors,
+       kept in memory until they are committed all at once, so
+       that they get consecutive sectors and the inode and extent
+       tree are updated once for the lot.  They are file blocks
+       DELAY_FIRST through DELAY_FIRST + DELAY_CNT - 1.  Protected
+       by extension_lock. */
+    uint8_t *delay[INODE_DELAY_CNT];    /* Block contents. */
+    size_t delay_first;                 /* First delayed block. */
+    size_t delay_cnt;                   /* Number of delayed blocks. */
   };
 
 
-// Must free inode_disk after this function has been called
-static struct inode_disk*
-get_disk_inode (const struct inode *inode)
+/* Open inodes, keyed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Protects open_inodes and every inode's open_cnt and busy.  Not
+   held during I/O: an inode being read in by inode_open(), or
+   written back by a final inode_close(), stays in open_inodes
+   marked busy, and anyone who opens its sector meanwhile waits on
+   its READY condition.  So an inode is never reopened from disk
+   before its in-memory state has been written back. */
+static struct lock inode_lock;
+
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
+
+/* Allocates a sector from the free map, preferring GOAL, stores it
+   in *SECTORP and fills it with zeros in the cache.  Returns true
+   if successful, false if the disk is full.  The zeros are
+   written as file data, so they are not logged in the journal;
+   the sector is logged only if metadata is written to it. */
+static bool
+allocate_zeroed (block_sector_t goal, block_sector_t *sectorp)
 {
-  struct inode_disk *disk_inode = NULL;
+  static const uint8_t zeros[BLOCK_SECTOR_SIZE];
+
+  if (free_map_allocate_run (goal, 1, sectorp) == 0)
+    return false;
+  cache_write_at (*sectorp, zeros, 0, BLOCK_SECTOR_SIZE, false);
+  return true;
+}
+
+/* Returns the size of the entries of a node with header H. */
+static size_t
+entry_size (const struct extent_header *h)
+{
+  return h->depth > 0 ? sizeof (struct extent_index) : sizeof (struct extent);
+}
+
+/* Returns the number of entries in the node with header H and
+   ENTRIES that begin at or before file block BLOCK.  Extents and
+   extent_indexes both begin with their first file block. */
+static size_t
+entry_pos (const struct extent_header *h, const uint8_t *entries,
+           uint32_t block)
+{
+  size_t esz = entry_size (h);
+  size_t i;
+
+  for (i = 0; i < h->cnt; i++)
+    if (*(const uint32_t *) (entries + i * esz) > block)
+      break;
+  return i;
+}
 
-  disk_inode = calloc (1, sizeof *disk_inode);
+/* Looks up file block BLOCK in the extent tree rooted in
+   DISK_INODE.  If it is mapped, stores the extent that maps it in
+   *EXT and returns true; otherwise returns false. */
+static bool
+extent_lookup (struct inode_disk *disk_inode, uint32_t block,
+               struct extent *ext)
+{
+  struct extent_header *h = &disk_inode->root;
+  uint8_t *entries = disk_inode->root_entries;
+  struct cache_entry *c = NULL;
+  bool found = false;
+  size_t pos;
 
-  if (disk_inode != NULL)
+  while (h->depth > 0)
   {
-    cache_read_at (inode->sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
-    return disk_inode;
+    struct extent_node *node;
+    block_sector_t child;
+
+    pos = entry_pos (h, entries, block);
+    if (pos == 0)
+      goto done;
+    child = ((struct extent_index *) entries)[pos - 1].child;
+    if (c != NULL)
+      cache_unpin (c, false);
+
+    c = cache_pin (child);
+    node = cache_buffer (c);
+    h = &node->header;
+    entries = node->entries;
   }
 
-  return NULL;
-}
+  pos = entry_pos (h, entries, block);
+  if (pos > 0)
+  {
+    struct extent *e = (struct extent *) entries + (pos - 1);
+    if (block - e->block < e->len)
+    {
+      *ext = *e;
+      found = true;
+    }
+  }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+  done:
+    if (c != NULL)
+      cache_unpin (c, false);
+    return found;
+}
 
-static block_sector_t
-inode_disk_block_to_sector (struct inode_disk *disk_inode, size_t block_idx, struct indirect_block *indirect_block,
-    struct indirect_block *double_indirect_block, bool create)
+/* Adds ENTRY, an extent or an extent_index according to H's
+   depth, to the node with header H and ENTRIES, which has room
+   for BYTES bytes of entries.  ROOT is true if this is the root
+   of the tree.
+
+   If the node is full, a full root is pushed down into a new
+   child node, which has room to spare, and any other node is
+   split in two; in the latter case *SPLIT receives the index
+   entry for the new right-hand node, which the caller must add
+   to the parent.  Otherwise SPLIT->child is set to 0.  Returns
+   false if a new node cannot be allocated. */
+static bool
+node_add (struct extent_header *h, uint8_t *entries, size_t bytes, bool root,
+          const void *entry, struct extent_index *split)
 {
+  size_t esz = entry_size (h);
+  size_t pos = entry_pos (h, entries, *(const uint32_t *) entry);
+  struct extent_index no_split;
+  struct extent_node *node;
+  struct cache_entry *c;
   block_sector_t sector;
-  if (block_idx < NUM_DIRECT)
+  size_t move;
+
+  split->child = 0;
+  if ((h->cnt + 1) * esz <= bytes)
   {
-    sector = disk_inode->direct[block_idx];
-    if (sector == 0 && create)
-    {
-      if (!free_map_allocate (&disk_inode->direct[block_idx]))
-        return 0;
-      struct indirect_block *zeros = calloc (1, sizeof (struct indirect_block));
-      cache_write_at (disk_inode->direct[block_idx], zeros, 0, BLOCK_SECTOR_SIZE);
-      free (zeros);
+    memmove (entries + (pos + 1) * esz, entries + pos * esz,
+             (h->cnt - pos) * esz);
+    memcpy (entries + pos * esz, entry, esz);
+    h->cnt++;
+    return true;
+  }
 
-      // printf ("direct sector created : %d\n", disk_inode->direct[block_idx]);
+  if (!free_map_allocate (&sector))
+    return false;
+  c = cache_pin_zeroed (sector);
+  node = cache_buffer (c);
+  node->header.depth = h->depth;
 
-      return disk_inode->direct[block_idx];
-    }
-    // printf ("direct : %d\n", sector);
-    return sector;
+  if (root)
+  {
+    struct extent_index *index = (struct extent_index *) entries;
+
+    memcpy (node->entries, entries, h->cnt * esz);
+    node->header.cnt = h->cnt;
+    h->depth++;
+    h->cnt = 1;
+    index[0].block = 0;
+    index[0].child = sector;
+    node_add (&node->header, node->entries, NODE_BYTES, false, entry,
+              &no_split);
+  }
+  else
+  {
+    /* A node being appended to keeps all its entries, so that a
+       file written sequentially leaves its nodes full. */
+    move = pos == h->cnt ? 0 : h->cnt / 2;
+    memcpy (node->entries, entries + (h->cnt - move) * esz, move * esz);
+    node->header.cnt = move;
+    h->cnt -= move;
+    if (move > 0 && pos <= h->cnt)
+      node_add (h, entries, bytes, false, entry, &no_split);
+    else
+      node_add (&node->header, node->entries, NODE_BYTES, false, entry,
+                &no_split);
+
+    split->block = *(uint32_t *) node->entries;
+    split->child = sector;
   }
-  //indirect
-  else if (NUM_DIRECT <= block_idx && block_idx < NUM_DIRECT + 128)
+
+  cache_unpin (c, true);
+  return true;
+}
+
+/* Maps file block BLOCK, which must not already be mapped, to
+   SECTOR in the subtree under the node with header H and ENTRIES,
+   as for node_add().  Lengthens an adjacent extent if possible.
+   Sets *SPLIT as node_add() does.  Returns false if a new node
+   cannot be allocated. */
+static bool
+extent_insert (struct extent_header *h, uint8_t *entries, size_t bytes,
+               bool root, uint32_t block, block_sector_t sector,
+               struct extent_index *split)
+{
+  size_t pos = entry_pos (h, entries, block);
+
+  split->child = 0;
+  if (h->depth == 0)
   {
-    if (create && disk_inode->indirect[0] == 0)
+    struct extent *ext = (struct extent *) entries;
+    struct extent e;
+
+    if (pos > 0 && ext[pos - 1].block + ext[pos - 1].len == block
+        && ext[pos - 1].start + ext[pos - 1].len == sector)
     {
-      if(!free_map_allocate (&disk_inode->indirect[0]))
-        return 0;
-      cache_write_at (disk_inode->indirect[0], indirect_block->indirect_blocks, 0, BLOCK_SECTOR_SIZE);
+      ext[pos - 1].len++;
+      return true;
     }
-    else if (disk_inode->indirect[0] == 0)
-      return 0;
-    cache_read_at (disk_inode->indirect[0], indirect_block->indirect_blocks, 0, BLOCK_SECTOR_SIZE);
-    sector = indirect_block->indirect_blocks[block_idx - NUM_DIRECT];
-    if (sector == 0 && create)
+    if (pos < h->cnt && block + 1 == ext[pos].block
+        && sector + 1 == ext[pos].start)
     {
-      if (!free_map_allocate (&indirect_block->indirect_blocks[block_idx - NUM_DIRECT]))
-        return 0;
-      cache_write_at (disk_inode->indirect[0], indirect_block->indirect_blocks, 0, BLOCK_SECTOR_SIZE);
-
-      struct indirect_block *zeros = calloc (1, sizeof (struct indirect_block));
-      cache_write_at (indirect_block->indirect_blocks[block_idx - NUM_DIRECT], zeros, 0, BLOCK_SECTOR_SIZE);
-      free (zeros);
-
-      // printf ("indirect sector created : %d\n", indirect_block->indirect_blocks[block_idx - NUM_DIRECT]);
-      return indirect_block->indirect_blocks[block_idx - NUM_DIRECT];
+      ext[pos].block--;
+      ext[pos].start--;
+      ext[pos].len++;
+      return true;
     }
-    // printf ("existing indirect : %d\n", sector);
-    return sector;
+
+    e.block = block;
+    e.len = 1;
+    e.start = sector;
+    return node_add (h, entries, bytes, root, &e, split);
+  }
+  else
+  {
+    struct extent_index *index = (struct extent_index *) entries;
+    struct extent_index child_split;
+    struct extent_node *node;
+    struct cache_entry *c;
+    bool success;
+
+    c = cache_pin (index[pos > 0 ? pos - 1 : 0].child);
+    node = cache_buffer (c);
+    success = extent_insert (&node->header, node->entries, NODE_BYTES, false,
+                             block, sector, &child_split);
+    cache_unpin (c, true);
+
+    if (success && child_split.child != 0)
+      success = node_add (h, entries, bytes, root, &child_split, split);
+    return success;
   }
-  //double indirect
-  else if (NUM_DIRECT + 128 <= block_idx && block_idx < NUM_SECTORS)
+}
+
+/* Releases every block mapped by the subtree under the node with
+   header H and ENTRIES, along with the subtree's other nodes. */
+static void
+extent_free (struct extent_header *h, uint8_t *entries)
+{
+  for (size_t i = 0; i < h->cnt; i++)
   {
-    if (create && disk_inode->double_indirect[0] == 0)
+    if (h->depth == 0)
     {
-      if (!free_map_allocate (&disk_inode->double_indirect[0]))
-        return 0;
-      cache_write_at (disk_inode->double_indirect[0], indirect_block->indirect_blocks, 0, BLOCK_SECTOR_SIZE);
+      struct extent *e = (struct extent *) entries + i;
+      for (uint32_t j = 0; j < e->len; j++)
+        cache_remove (e->start + j);
+      free_map_release (e->start, e->len);
     }
-    else if (disk_inode->double_indirect[0] == 0)
-      return 0;
+    else
+    {
+      block_sector_t child = ((struct extent_index *) entries)[i].child;
+      struct cache_entry *c = cache_pin (child);
+      struct extent_node *node = cache_buffer (c);
+
+      extent_free (&node->header, node->entries);
+      cache_unpin (c, false);
+      cache_remove (child);
+      free_map_release (child, 1);
+    }
+  }
+}
 
-    int index = block_idx - (NUM_DIRECT + 128);
+/* Maps block BLOCK_IDX of DISK_INODE, which must not already be
+   mapped, to SECTOR.  Returns false if an extent tree node cannot
+   be allocated. */
+static bool
+inode_disk_map (struct inode_disk *disk_inode, size_t block_idx,
+                block_sector_t sector)
+{
+  struct extent_index split;
 
-    cache_read_at (disk_inode->double_indirect[0], indirect_block->indirect_blocks, 0, BLOCK_SECTOR_SIZE);
+  if (!extent_insert (&disk_inode->root, disk_inode->root_entries,
+                      ROOT_BYTES, true, block_idx, sector, &split))
+    return false;
+  ASSERT (split.child == 0);
+  return true;
+}
 
-    if (create && indirect_block->indirect_blocks[index / BLOCK_SECTOR_SIZE] == 0)
-    {
-      if (!free_map_allocate (&indirect_block->indirect_blocks[index / BLOCK_SECTOR_SIZE]))
-        return 0;
-      cache_write_at (indirect_block->indirect_blocks[index / BLOCK_SECTOR_SIZE], double_indirect_block->indirect_blocks, 0, BLOCK_SECTOR_SIZE);
-      cache_write_at (disk_inode->double_indirect[0], indirect_block->indirect_blocks, 0, BLOCK_SECTOR_SIZE);
-    }
-    else if (indirect_block->indirect_blocks[index / BLOCK_SECTOR_SIZE] == 0)
-      return 0;
+/* Returns the sector holding block BLOCK_IDX of DISK_INODE, which
+   is stored in sector HOME, or 0 if there is none.  If CREATE is
+   true, allocates the block and maps it first, in which case the
+   caller must write DISK_INODE back. */
+static block_sector_t
+inode_disk_block_to_sector (struct inode_disk *disk_inode,
+                            block_sector_t home, size_t block_idx,
+                            bool create)
+{
+  struct extent ext;
+  block_sector_t goal, sector;
+
+  if (extent_lookup (disk_inode, block_idx, &ext))
+    return ext.start + (block_idx - ext.block);
+  if (!create)
+    return 0;
 
-    cache_read_at (indirect_block->indirect_blocks[index / BLOCK_SECTOR_SIZE], double_indirect_block->indirect_blocks, 0, BLOCK_SECTOR_SIZE);
-    sector = double_indirect_block->indirect_blocks[index % BLOCK_SECTOR_SIZE];
+  /* Try to place the block right after its predecessor, or after
+     the inode itself for the first block, so that sequential
+     writes extend the previous extent. */
+  goal = home + 1;
+  if (block_idx > 0 && extent_lookup (disk_inode, block_idx - 1, &ext))
+    goal = ext.start + (block_idx - 1 - ext.block) + 1;
+  if (!allocate_zeroed (goal, &sector))
+    return 0;
+  if (!inode_disk_map (disk_inode, block_idx, sector))
+  {
+    cache_remove (sector);
+    free_map_release (sector, 1);
+    return 0;
+  }
+  return sector;
+}
+
+/* Returns the sector holding block BLOCK_IDX of INODE according
+   to INODE's in-memory extents, or 0 if they do not map it. */
+static block_sector_t
+inode_map_lookup (struct inode *inode, uint32_t block_idx)
+{
+  block_sector_t sector = 0;
 
-    if (sector == 0 && create)
+  lock_acquire (&inode->map_lock);
+  for (size_t i = 0; i < INODE_MAP_CNT; i++)
+  {
+    const struct extent *e = &inode->map[i];
+    if (block_idx - e->block < e->len)
     {
-      if (!free_map_allocate (&double_indirect_block->indirect_blocks[index % BLOCK_SECTOR_SIZE]))
-        return 0;
-      cache_write_at (indirect_block->indirect_blocks[index / BLOCK_SECTOR_SIZE],
-                      double_indirect_block->indirect_blocks, 0, BLOCK_SECTOR_SIZE);
-      cache_write_at (disk_inode->double_indirect[0], indirect_block->indirect_blocks, 0, BLOCK_SECTOR_SIZE);
-
-      struct indirect_block *zeros = calloc (1, sizeof (struct indirect_block));
-      cache_write_at (double_indirect_block->indirect_blocks[index % BLOCK_SECTOR_SIZE], zeros, 0, BLOCK_SECTOR_SIZE);
-      free (zeros);
-      // printf ("double indirect sector created : %d\n", double_indirect_block->indirect_blocks[index % BLOCK_SECTOR_SIZE]);
-      return double_indirect_block->indirect_blocks[index % BLOCK_SECTOR_SIZE];
+      sector = e->start + (block_idx - e->block);
+      break;
     }
-    // printf ("existing double indirect : %d\n", sector);
-    return sector;
   }
-  ASSERT (0);
+  lock_release (&inode->map_lock);
+
+  return sector;
+}
+
+/* Remembers extent EXT in INODE's in-memory extents, replacing
+   the oldest. */
+static void
+inode_map_add (struct inode *inode, const struct extent *ext)
+{
+  lock_acquire (&inode->map_lock);
+  inode->map[inode->map_next] = *ext;
+  inode->map_next = (inode->map_next + 1) % INODE_MAP_CNT;
+  lock_release (&inode->map_lock);
+}
+
+/* Forgets INODE's in-memory extents, which may have become stale
+   or incomplete because INODE's extent tree changed. */
+static void
+inode_map_invalidate (struct inode *inode)
+{
+  lock_acquire (&inode->map_lock);
+  memset (inode->map, 0, sizeof inode->map);
+  inode->map_next = 0;
+  lock_release (&inode->map_lock);
 }
 
+/* Returns the sector holding block BLOCK_IDX of INODE, or 0 if
+   there is none, allocating it first if CREATE is true.  Blocks
+   mapped by INODE's in-memory extents are resolved without
+   touching the cache; otherwise the on-disk inode is accessed in
+   place in the cache. */
 static block_sector_t
-inode_block_to_sector (struct inode *inode, size_t block_idx, struct indirect_block *indirect_block,
-    struct indirect_block *double_indirect_block, bool create)
+inode_block_to_sector (struct inode *inode, size_t block_idx, bool create)
+{
+  struct cache_entry *c;
+  struct inode_disk *disk_inode;
+  struct extent ext;
+  block_sector_t sector;
+
+  sector = inode_map_lookup (inode, block_idx);
+  if (sector != 0)
+    return sector;
+
+  c = cache_pin (inode->sector);
+  disk_inode = cache_buffer (c);
+  if (extent_lookup (disk_inode, block_idx, &ext))
+  {
+    inode_map_add (inode, &ext);
+    sector = ext.start + (block_idx - ext.block);
+  }
+  else if (create)
+  {
+    sector = inode_disk_block_to_sector (disk_inode, inode->sector,
+                                          block_idx, true);
+    inode_map_invalidate (inode);
+  }
+  cache_unpin (c, create);
+
+  return sector;
+}
+
+/* Returns the delayed contents of block BLOCK_IDX of INODE, or a
+   null pointer if the block is not delayed. */
+static uint8_t *
+inode_delayed (struct inode *inode, size_t block_idx)
+{
+  if (block_idx - inode->delay_first < inode->delay_cnt)
+    return inode->delay[block_idx - inode->delay_first];
+  return NULL;
+}
+
+/* Frees INODE's delayed blocks without writing them. */
+static void
+inode_discard_delayed (struct inode *inode)
+{
+  for (size_t i = 0; i < inode->delay_cnt; i++)
+    free (inode->delay[i]);
+  inode->delay_cnt = 0;
+}
+
+/* Allocates sectors for INODE's delayed blocks, as few runs as
+   the free map allows, starting right after the sector of the
+   preceding block, and writes the blocks into the cache.  The
+   on-disk inode is pinned once for the whole batch.
+
+   Returns false if the disk fills up.  Blocks that could not be
+   given sectors are dropped and read back as zeros, so, as with
+   other file systems that delay allocation, running out of space
+   can lose data from writes that have already returned. */
+static bool
+inode_commit_delayed (struct inode *inode)
+{
+  struct cache_entry *c;
+  struct inode_disk *disk_inode;
+  struct extent ext;
+  block_sector_t goal, start;
+  size_t done = 0;
+  bool success = true;
+
+  if (inode->delay_cnt == 0)
+    return true;
+
+  c = cache_pin (inode->sector);
+  disk_inode = cache_buffer (c);
+  goal = inode->sector + 1;
+  if (inode->delay_first > 0
+      && extent_lookup (disk_inode, inode->delay_first - 1, &ext))
+    goal = ext.start + (inode->delay_first - 1 - ext.block) + 1;
+
+  while (success && done < inode->delay_cnt)
+  {
+    size_t n = free_map_allocate_run (goal, inode->delay_cnt - done, &start);
+
+    if (n == 0)
+      success = false;
+    for (size_t i = 0; i < n; i++)
+      if (!inode_disk_map (disk_inode, inode->delay_first + done + i,
+                           start + i))
+      {
+        free_map_release (start + i, n - i);
+        n = i;
+        success = false;
+        break;
+      }
+    for (size_t i = 0; i < n; i++)
+      cache_write_at (start + i, inode->delay[done + i], 0,
+                      BLOCK_SECTOR_SIZE, false);
+    done += n;
+    goal = start + n;
+  }
+  cache_unpin (c, done > 0);
+
+  inode_discard_delayed (inode);
+  inode_map_invalidate (inode);
+  return success;
+}
+
+/* Returns the delayed contents of block BLOCK_IDX of INODE, which
+   has no sector, delaying the block first, zero-filled, if it is
+   not already.  Commits the blocks already delayed if there is no
+   room for another or it would not extend their run.  Returns a
+   null pointer if memory or disk space runs out. */
+static uint8_t *
+inode_delay (struct inode *inode, size_t block_idx)
 {
-  struct inode_disk *disk_inode = get_disk_inode (inode);
+  uint8_t *block = inode_delayed (inode, block_idx);
 
-  ASSERT (disk_inode != NULL);
+  if (block != NULL)
+    return block;
+
+  if ((inode->delay_cnt == INODE_DELAY_CNT
+       || (inode->delay_cnt > 0
+           && block_idx != inode->delay_first + inode->delay_cnt))
+      && !inode_commit_delayed (inode))
+    return NULL;
 
-  block_sector_t ret = inode_disk_block_to_sector (disk_inode, block_idx, indirect_block, double_indirect_block, create);
+  block = calloc (1, BLOCK_SECTOR_SIZE);
+  if (block == NULL)
+    return NULL;
+  if (inode->delay_cnt == 0)
+    inode->delay_first = block_idx;
+  inode->delay[inode->delay_cnt++] = block;
+  return block;
+}
 
-  if (create)
-    cache_write_at (inode->sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
+/* Copies the fields INODE keeps in memory back into its on-disk
+   inode in the cache, if they have changed. */
+static void
+inode_sync (struct inode *inode)
+{
+  struct cache_entry *c;
+  struct inode_disk *disk_inode;
 
-  free (disk_inode);
+  if (!inode->dirty)
+    return;
+  c = cache_pin (inode->sector);
+  disk_inode = cache_buffer (c);
+  disk_inode->length = inode->length;
+  disk_inode->entry_cnt = inode->entry_cnt;
+  cache_unpin (c, true);
+  inode->dirty = false;
+}
 
-  return ret;
+/* Begins a journal operation that may commit an inode's delayed
+   blocks, if COMMIT is true.  Their sectors can come from
+   anywhere on the disk, so such an operation needs room for the
+   whole free map.  The extent tree nodes and the inode they
+   update fit in JOURNAL_OP_MAX, since at most INODE_DELAY_CNT
+   consecutive file blocks, which all go into the same few leaves,
+   are committed at once. */
+static void
+inode_journal_begin (bool commit)
+{
+  if (commit)
+    journal_begin_large ();
+  else
+    journal_begin ();
 }
 
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
-  list_init (&open_inodes);
-  //lock_init (&inode_lock);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("open inode table allocation failed");
+  lock_init (&inode_lock);
+}
+
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_int (inode->sector);
+}
+
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  const struct inode *i_a = hash_entry (a, struct inode, elem);
+  const struct inode *i_b = hash_entry (b, struct inode, elem);
+  return i_a->sector < i_b->sector;
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  The data is a hole that reads as zeros and takes no
+   sectors until it is written, so creating a file takes the same
+   time whatever its length.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool
 inode_create (block_sector_t sector, off_t length, bool isdir)
 {
+  struct cache_entry *c;
   struct inode_disk *disk_inode = NULL;
   bool success = false;
 
   ASSERT (length >= 0);
 
-  /* If this assertion fails, the inode structure is not exactly
-     one sector in size, and you should fix that. */
+  /* If these assertions fail, the inode or extent tree node
+     structure is not exactly one sector in size, and you should
+     fix that. */
   ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_node) == BLOCK_SECTOR_SIZE);
+
+  /* Build the inode in place in its cache buffer. */
+  c = cache_pin_zeroed (sector);
+  disk_inode = cache_buffer (c);
+
+  size_t sectors = bytes_to_sectors (length);
+  // printf ("\nCreate: length %d, sector: %d, num sectors %d, isdir %d\n", length, sector, sectors, isdir);
+  disk_inode->length = length;
+  disk_inode->magic = INODE_MAGIC;
+  disk_inode->version = INODE_VERSION;
+  disk_inode->isdir = isdir;
+  disk_inode->entry_cnt = 0;
+
+  /* The free map's own file is written with the free map locked,
+     so it cannot have holes whose writes would need sectors
+     allocated.  Its blocks are zero-filled as they are mapped. */
+  if (sector == FREE_MAP_SECTOR)
+    for (size_t i = 0; i < sectors; i++)
+      if (inode_disk_block_to_sector (disk_inode, sector, i, true) == 0)
+        goto done;
 
-  disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
-    {
-      size_t sectors = bytes_to_sectors (length);
-      // printf ("\nCreate: length %d, sector: %d, num sectors %d, isdir %d\n", length, sector, sectors, isdir);
-      disk_inode->length = length;
-      disk_inode->magic = INODE_MAGIC;
-      disk_inode->isdir = isdir;
-      disk_inode->entry_cnt = 0;
-
-      struct indirect_block *indirect_block = NULL;
-      struct indirect_block *double_indirect_block = NULL;
-      struct indirect_block *zeros = calloc (1, sizeof (struct indirect_block));
-      block_sector_t res;
-
-      indirect_block = calloc (1, sizeof (struct indirect_block));
-      double_indirect_block = calloc (1, sizeof (struct indirect_block));
-
-
-      for (size_t i = 0; i < sectors; i++)
-      {
-        memset (indirect_block, 0, sizeof (struct indirect_block));
-        memset (double_indirect_block, 0, sizeof (struct indirect_block));
-        res = inode_disk_block_to_sector (disk_inode, i, indirect_block, double_indirect_block, true);
-        if (res == 0)
-          goto done;
-        cache_write_at (res, zeros, 0, BLOCK_SECTOR_SIZE);
-      }
-
-      // printf ("disk_inode->length = %d @ sector %d\n", disk_inode->length, sector);
-
-      cache_write_at (sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
-
-      free (zeros);
-      free (indirect_block);
-      free (double_indirect_block);
+  // printf ("disk_inode->length = %d @ sector %d\n", disk_inode->length, sector);
 
-      success = true;
-      goto done;
-    }
+  success = true;
 
   done:
     //printf ("create done\n");
-    free (disk_inode);
+    cache_unpin (c, success);
     return success;
 }
 
 /* Reads an inode from SECTOR
    and returns a `struct inode' that contains it.
-   Returns a null pointer if memory allocation fails. */
+   Returns a null pointer if memory allocation fails or if SECTOR
+   does not hold an inode in the current on-disk format. */
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
+  /* Check whether this inode is already open.  If it is being
+     read in or written out, wait and look again, since it may be
+     gone by then. */
   // printf ("Opening sector %d\n", sector);
-  //lock_acquire (&inode_lock);
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
+  lock_acquire (&inode_lock);
+  key.sector = sector;
+  while ((e = hash_find (&open_inodes, &key.elem)) != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
+      inode = hash_entry (e, struct inode, elem);
+      if (!inode->busy)
         {
-          //lock_release (&inode_lock);
-          inode_reopen (inode);
+          inode->open_cnt++;
+          lock_release (&inode_lock);
           return inode;
         }
+      cond_wait (&inode->ready, &inode_lock);
     }
 
-
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
   {
-    //lock_release (&inode_lock);
+    lock_release (&inode_lock);
     return NULL;
   }
 
-  struct inode_disk *disk_inode = calloc (1, sizeof (struct inode_disk));
-  cache_read_at (sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
+  /* Claim SECTOR, then read it without holding inode_lock. */
+  inode->sector = sector;
+  inode->open_cnt = 1;
+  inode->busy = true;
+  cond_init (&inode->ready);
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&inode_lock);
+
+  struct cache_entry *c = cache_pin (sector);
+  struct inode_disk *disk_inode = cache_buffer (c);
   // printf ("length for sector %d", disk_inode->length);
+  if (disk_inode->magic != INODE_MAGIC
+      || disk_inode->version != INODE_VERSION)
+  {
+    cache_unpin (c, false);
+    lock_acquire (&inode_lock);
+    hash_delete (&open_inodes, &inode->elem);
+    cond_broadcast (&inode->ready, &inode_lock);
+    lock_release (&inode_lock);
+    free (inode);
+    return NULL;
+  }
 
   /* Initialize. */
-  inode->sector = sector;
-  inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
   inode->length = disk_inode->length;
   // printf ("Open: length = %d\n", inode->length);
   inode->entry_cnt = disk_inode->entry_cnt;
   inode->isdir = disk_inode->isdir;
+  inode->dirty = false;
   lock_init (&inode->extension_lock);
-  list_push_front (&open_inodes, &inode->elem);
-  //lock_release (&inode_lock);
+  inode->ra_next = 0;
+  inode->ra_window = 0;
+  inode->ra_end = 0;
+  lock_init (&inode->map_lock);
+  memset (inode->map, 0, sizeof inode->map);
+  inode->map_next = 0;
+  inode->delay_first = 0;
+  inode->delay_cnt = 0;
   // block_read (fs_device, inode->sector, &inode->data);
-  free (disk_inode);
+  cache_unpin (c, false);
+
+  lock_acquire (&inode_lock);
+  inode->busy = false;
+  cond_broadcast (&inode->ready, &inode_lock);
+  lock_release (&inode_lock);
   return inode;
 }
 
@@ -335,7 +837,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
+  {
+    lock_acquire (&inode_lock);
     inode->open_cnt++;
+    lock_release (&inode_lock);
+  }
   return inode;
 }
 
@@ -364,94 +870,54 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&inode_lock);
+  if (--inode->open_cnt > 0)
     {
-      /* Remove from inode list and release lock. */
-      //lock_acquire (&inode_lock);
-      list_remove (&inode->elem);
-
-      /* Deallocate blocks if removed. */
-      if (inode->removed)
-        {
-          struct indirect_block *indirect_block = NULL;
-          struct indirect_block *double_indirect_block = NULL;
-
-          size_t sectors = bytes_to_sectors (inode_length (inode));
-
-          indirect_block = calloc (1, sizeof(struct indirect_block));
-          double_indirect_block = calloc (1, sizeof(struct indirect_block));
-
-          for (size_t i = 0; i < sectors; i++)
-          {
-            memset (indirect_block, 0, sizeof (struct indirect_block));
-            memset (double_indirect_block, 0, sizeof (struct indirect_block));
-            lock_acquire (&inode->extension_lock);
-            block_sector_t sector = inode_block_to_sector (inode, i, indirect_block,
-                        double_indirect_block, false);
-            lock_release (&inode->extension_lock);
-            if (sector != 0)
-            {
-              cache_remove (sector);
-              free_map_release (sector);
-            }
-          }
-
-          lock_acquire (&inode->extension_lock);
-          struct inode_disk *disk_inode = get_disk_inode (inode);
-          lock_release (&inode->extension_lock);
-
-          if (disk_inode->indirect[0] != 0)
-          {
-            cache_remove (disk_inode->indirect[0]);
-            free_map_release (disk_inode->indirect[0]);
-          }
-
-          if (disk_inode->double_indirect[0] != 0)
-          {
-            cache_read_at (disk_inode->double_indirect[0], indirect_block, 0, BLOCK_SECTOR_SIZE);
-            for (int i = 0; i < BLOCK_SECTOR_SIZE; i++)
-            {
-              if (indirect_block->indirect_blocks[i] != 0)
-              {
-                cache_remove (indirect_block->indirect_blocks[i]);
-                free_map_release (indirect_block->indirect_blocks[i]);
-              }
-            }
-            cache_remove (disk_inode->double_indirect[0]);
-            free_map_release (disk_inode->double_indirect[0]);
-          }
-
-          cache_remove (inode->sector);
-          free_map_release (inode->sector);
-
-          free (indirect_block);
-          free (double_indirect_block);
-
-          free (disk_inode);
-        }
-
-      else
-        {
-          lock_acquire (&inode->extension_lock);
-          struct inode_disk *disk_inode = get_disk_inode (inode);
-          lock_release (&inode->extension_lock);
-
-          if (disk_inode != NULL)
-          {
-            disk_inode->length = inode->length;
-            disk_inode->entry_cnt = inode->entry_cnt;
-            disk_inode->isdir = inode->isdir;
-          }
+      lock_release (&inode_lock);
+      return;
+    }
 
-          cache_write_at (inode->sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
+  /* Write INODE back without holding inode_lock.  It stays in
+     open_inodes, marked busy, so that inode_open() of its sector
+     waits until it is written back. */
+  inode->busy = true;
+  lock_release (&inode_lock);
 
-          free (disk_inode);
-        }
+  /* Deallocate blocks if removed. */
+  if (inode->removed)
+    {
+      journal_begin_large ();
+      lock_acquire (&inode->extension_lock);
+      inode_discard_delayed (inode);
+      struct cache_entry *c = cache_pin (inode->sector);
+      struct inode_disk *disk_inode = cache_buffer (c);
+      extent_free (&disk_inode->root, disk_inode->root_entries);
+      cache_unpin (c, false);
+      lock_release (&inode->extension_lock);
 
-      //lock_release (&inode_lock);
+      cache_remove (inode->sector);
+      free_map_release (inode->sector, 1);
+      journal_end ();
+    }
 
-      free (inode);
+  /* Write back whatever changed.  An inode that was only read
+     needs no journal operation. */
+  else if (inode->delay_cnt > 0 || inode->dirty)
+    {
+      inode_journal_begin (inode->delay_cnt > 0);
+      lock_acquire (&inode->extension_lock);
+      inode_commit_delayed (inode);
+      inode_sync (inode);
+      lock_release (&inode->extension_lock);
+      journal_end ();
     }
+
+  /* Remove from inode table. */
+  lock_acquire (&inode_lock);
+  hash_delete (&open_inodes, &inode->elem);
+  cond_broadcast (&inode->ready, &inode_lock);
+  lock_release (&inode_lock);
+  free (inode);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -463,6 +929,67 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
+/* Updates INODE's sequential-read state for a read of SIZE bytes
+   at OFFSET and, if the reader looks sequential, asks the cache to
+   prefetch the rest of this read plus the read-ahead window.
+   Blocks are mapped through INODE's block map, so files need not
+   be physically contiguous.  Random readers get no read-ahead. */
+static void
+inode_read_ahead (struct inode *inode, off_t size, off_t offset)
+{
+  size_t first, last, start, end, file_blocks;
+
+  if (size <= 0 || offset >= inode_length (inode))
+    return;
+
+  if (!inode->isdir)
+    lock_acquire (&inode->extension_lock);
+
+  first = offset / BLOCK_SECTOR_SIZE;
+  last = (offset + size - 1) / BLOCK_SECTOR_SIZE;
+
+  if (first != inode->ra_next)
+  {
+    inode->ra_window = 0;
+    inode->ra_end = 0;
+  }
+  else if (inode->ra_window == 0)
+    inode->ra_window = RA_MIN_WINDOW;
+  else if (inode->ra_window < RA_MAX_WINDOW)
+    inode->ra_window *= 2;
+  inode->ra_next = (offset + size) / BLOCK_SECTOR_SIZE;
+
+  if (inode->ra_window != 0)
+  {
+    file_blocks = bytes_to_sectors (inode_length (inode));
+    start = first + 1 > inode->ra_end ? first + 1 : inode->ra_end;
+    end = last + 1 + inode->ra_window;
+    if (end > file_blocks)
+      end = file_blocks;
+
+    for (size_t block = start; block < end; block++)
+    {
+      block_sector_t sector = inode_block_to_sector (inode, block, false);
+      if (sector != 0)
+        cache_prefetch (sector);
+    }
+    if (end > inode->ra_end)
+      inode->ra_end = end;
+  }
+
+  if (!inode->isdir)
+    lock_release (&inode->extension_lock);
+}
+
+/* Returns true if INODE's contents are file system metadata,
+   which the buffer cache keeps resident in preference to file
+   data. */
+static bool
+inode_is_metadata (const struct inode *inode)
+{
+  return inode->isdir || inode->sector == FREE_MAP_SECTOR;
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
@@ -472,22 +999,15 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
 
-  struct indirect_block *indirect_block = NULL;
-  struct indirect_block *double_indirect_block = NULL;
-
-  indirect_block = calloc (1, sizeof (struct indirect_block));
-  double_indirect_block = calloc (1, sizeof (struct indirect_block));
-
   // printf ("read: offset = %d, size = %d, length: %d to inode->sector %d\n", offset, size, inode_length(inode), inode->sector);
 
+  inode_read_ahead (inode, size, offset);
+
   while (size > 0)
     {
       /* Disk sector to read, starting byte offset within sector. */
       int block_idx = offset/BLOCK_SECTOR_SIZE;
 
-      memset (indirect_block, 0, sizeof (struct indirect_block));
-      memset (double_indirect_block, 0, sizeof (struct indirect_block));
-
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -507,12 +1027,23 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
         break;
       }
 
-      block_sector_t sector_idx = inode_block_to_sector (inode, block_idx,
-                indirect_block, double_indirect_block, false);
+      block_sector_t sector_idx = inode_block_to_sector (inode, block_idx, false);
+      uint8_t *delayed = sector_idx == 0 ? inode_delayed (inode, block_idx) : NULL;
       // printf ("reading from sector_idx: %d, offset: %d, size %d, inode left %d, block_idx %d\n", sector_idx, offset, size, inode_left, block_idx);
 
-      if (sector_idx == 0 && inode_left > 0)
+      if (delayed != NULL)
+      {
+        memcpy (buffer + bytes_read, delayed + sector_ofs, chunk_size);
+        size -= chunk_size;
+        offset += chunk_size;
+        bytes_read += chunk_size;
+        if (!inode->isdir)
+          lock_release (&inode->extension_lock);
+        continue;
+      }
+      else if (sector_idx == 0 && inode_left > 0)
       {
+        /* A hole, never written, reads as zeros. */
         memset (buffer + bytes_read, 0, chunk_size);
         size -= chunk_size;
         offset += chunk_size;
@@ -524,7 +1055,8 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       else if (sector_idx == 0)
         goto done;
 
-      cache_read_at (sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
+      cache_read_at (sector_idx, buffer + bytes_read, sector_ofs, chunk_size,
+                     inode_is_metadata (inode));
       if (!inode->isdir)
         lock_release (&inode->extension_lock);
 
@@ -535,16 +1067,16 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
     }
 
   done:
-    free (indirect_block);
-    free (double_indirect_block);
     return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk fills up or an error occurs.  A write
+   past end of file extends the inode.  Data written to blocks of a
+   regular file that have no sector yet stays in memory until
+   enough accumulates, the file is closed or the file system shuts
+   down; see inode_commit_delayed(). */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset)
@@ -555,12 +1087,6 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   if (inode->deny_write_cnt)
     return 0;
 
-  struct indirect_block *indirect_block = NULL;
-  struct indirect_block *double_indirect_block = NULL;
-
-  indirect_block = calloc (1, sizeof (struct indirect_block));
-  double_indirect_block = calloc (1, sizeof (struct indirect_block));
-
   // printf ("write: offset = %d, size = %d, length: %d to inode->sector %d\n", offset, size, inode_length(inode), inode->sector);
 
   while (size > 0)
@@ -581,71 +1107,44 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      memset (indirect_block, 0, sizeof (struct indirect_block));
-      memset (double_indirect_block, 0, sizeof (struct indirect_block));
-
-      if (offset + chunk_size > inode_length (inode))
-      {
-        if (!inode->isdir)
-          lock_acquire (&inode->extension_lock);
-
-        if (offset + chunk_size > inode_length (inode))
-        {
-          block_sector_t sector_idx = inode_block_to_sector (inode, block_idx,
-                    indirect_block, double_indirect_block, true);
-
-          if (sector_idx == 0)
-          {
-            if (!inode->isdir)
-              lock_release (&inode->extension_lock);
-            goto done;
-          }
-
-          inode->length = offset + chunk_size;
-          // printf ("(extension) writing to sector_idx: %d, offset: %d, chunk size %d\n", sector_idx, offset, chunk_size);
-          cache_write_at (sector_idx, buffer + bytes_written, sector_ofs, chunk_size);
-          if (!inode->isdir)
-            lock_release (&inode->extension_lock);
-
-        }
-        else
-        {
-          block_sector_t sector_idx = inode_block_to_sector (inode, block_idx,
-                    indirect_block, double_indirect_block, false);
-
-          if (sector_idx == 0)
-          {
-            if (!inode->isdir)
-              lock_release (&inode->extension_lock);
-            goto done;
-          }
-
-          // printf ("(non-extension) writing to sector_idx: %d, offset: %d, chunk size %d\n", sector_idx, offset, chunk_size);
-          cache_write_at (sector_idx, buffer + bytes_written, sector_ofs, chunk_size);
-          if (!inode->isdir)
-            lock_release (&inode->extension_lock);
-        }
+      /* Each block is written in its own journal operation, so
+         that a long write does not hold up commits.  Writing a
+         block of a regular file may commit its delayed blocks. */
+      inode_journal_begin (!inode_is_metadata (inode));
+      if (!inode->isdir)
+        lock_acquire (&inode->extension_lock);
 
-      }
+      /* Blocks of regular files that have no sector yet are
+         delayed, so that their sectors are allocated in a batch.
+         Otherwise fall back to allocating the block right away. */
+      block_sector_t sector_idx = inode_block_to_sector (inode, block_idx, false);
+      uint8_t *delayed = NULL;
+      if (sector_idx == 0 && !inode_is_metadata (inode))
+        delayed = inode_delay (inode, block_idx);
+      if (sector_idx == 0 && delayed == NULL)
+        sector_idx = inode_block_to_sector (inode, block_idx, true);
+
+      if (delayed != NULL)
+        memcpy (delayed + sector_ofs, buffer + bytes_written, chunk_size);
+      else if (sector_idx != 0)
+        cache_write_at (sector_idx, buffer + bytes_written, sector_ofs, chunk_size,
+                        inode_is_metadata (inode));
       else
       {
-        if (!inode->isdir)
-          lock_acquire (&inode->extension_lock);
-        block_sector_t sector_idx = inode_block_to_sector (inode, block_idx,
-                  indirect_block, double_indirect_block, false);
-
-        if (sector_idx == 0)
-        {
-          if (!inode->isdir)
-            lock_release (&inode->extension_lock);
-          goto done;
-        }
-
-        // printf ("(non-extension) writing to sector_idx: %d, offset: %d, chunk size %d\n", sector_idx, offset, chunk_size);
-        cache_write_at (sector_idx, buffer + bytes_written, sector_ofs, chunk_size);
         if (!inode->isdir)
           lock_release (&inode->extension_lock);
+        journal_end ();
+        goto done;
+      }
+
+      if (offset + chunk_size > inode_length (inode))
+      {
+        inode->length = offset + chunk_size;
+        inode->dirty = true;
       }
+      if (!inode->isdir)
+        lock_release (&inode->extension_lock);
+      journal_end ();
 
       /* Advance. */
       size -= chunk_size;
@@ -655,8 +1154,6 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 
   done:
     // printf ("success: %d\n", bytes_written);
-    free (indirect_block);
-    free (double_indirect_block);
     //printf ("bytes_written: %d\n", bytes_written);
 
     return bytes_written;
@@ -685,28 +1182,26 @@ inode_allow_write (struct inode *inode)
 void
 inode_done (void)
 {
-  //lock_acquire (&inode_lock);
-  struct list_elem *e;
-  struct inode *inode;
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_remove (e))
+  struct hash_iterator i;
+
+  /* Each inode is written back in its own journal operation.  No
+     other operation runs at shutdown, so waiting for room in the
+     transaction with inode_lock held cannot deadlock. */
+  lock_acquire (&inode_lock);
+  hash_first (&i, &open_inodes);
+  while (hash_next (&i))
     {
-      inode = list_entry (e, struct inode, elem);
+      struct inode *inode = hash_entry (hash_cur (&i), struct inode, elem);
+      if (inode->delay_cnt == 0 && !inode->dirty)
+        continue;
+      inode_journal_begin (inode->delay_cnt > 0);
       lock_acquire (&inode->extension_lock);
-      struct inode_disk *disk_inode = get_disk_inode (inode);
+      inode_commit_delayed (inode);
+      inode_sync (inode);
       lock_release (&inode->extension_lock);
-
-      if (disk_inode != NULL)
-      {
-        disk_inode->length = inode->length;
-        disk_inode->entry_cnt = inode->entry_cnt;
-        disk_inode->isdir = inode->isdir;
-      }
-
-      cache_write_at (inode->sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
-
+      journal_end ();
     }
-  //lock_release (&inode_lock);
+  lock_release (&inode_lock);
 }
 
 void
@@ -734,16 +1229,33 @@ inode_isdir (const struct inode *inode)
   return inode->isdir;
 }
 
+/* Returns true if SECTOR holds the inode of a directory.  The inode
+   need not be open, but the caller must keep SECTOR from being
+   freed meanwhile, e.g. by holding the extension lock of a
+   directory that lists it. */
+bool
+inode_sector_isdir (block_sector_t sector)
+{
+  struct cache_entry *c = cache_pin (sector);
+  struct inode_disk *disk_inode = cache_buffer (c);
+  bool isdir = disk_inode->magic == INODE_MAGIC && disk_inode->isdir;
+
+  cache_unpin (c, false);
+  return isdir;
+}
+
 void
 inode_entrycnt_inc (struct inode *inode)
 {
   inode->entry_cnt++;
+  inode->dirty = true;
 }
 
 void
 inode_entrycnt_dec (struct inode *inode)
 {
   inode->entry_cnt--;
+  inode->dirty = true;
 }
 
 bool
@@ -22,6 +22,7 @@ void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
 bool inode_isdir (const struct inode *);
+bool inode_sector_isdir (block_sector_t);
 void inode_entrycnt_inc (struct inode *);
 void inode_entrycnt_dec (struct inode *);
 bool inode_emptydir (const struct inode *);
@@ -0,0 +1,565 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/interrupt.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* The journal makes each update to file system metadata atomic,
+   so that after a crash the disk can be made consistent by
+   replaying the journal instead of checking the whole disk.
+
+   Every operation that modifies metadata (creating, removing or
+   closing a file, or writing a block of one) is bracketed by
+   journal_begin() and journal_end().  Metadata sectors that the
+   operation dirties in the buffer cache are logged in the running
+   transaction, and are never written to their home sectors
+   directly: when the cache writes one back, its contents are
+   saved in memory instead, and later reads of the sector are
+   served from that copy.
+
+   Operations are committed in groups.  The journal thread, woken
+   after each write-back pass or when the transaction is getting
+   full, stops new operations from beginning, waits for those in
+   progress to end, and then:
+
+     1. Writes the cache back, which sends file data home and
+        saves the latest contents of the logged sectors.
+
+     2. Writes the descriptor and a copy of each logged sector to
+        the journal, then the commit record.  Once the commit
+        record is on disk the transaction survives a crash.
+
+     3. Writes the logged sectors home, then clears the
+        descriptor.
+
+   Sectors freed by a transaction are not reused until it has
+   committed, so that data written to them cannot overwrite
+   metadata still in use on disk.
+
+   Recovery at boot reads the descriptor, and if a complete,
+   intact transaction follows it, writes the transaction's
+   sectors home again. */
+
+#define JOURNAL_MAGIC 0x4c4e524a        /* "JRNL". */
+#define COMMIT_MAGIC 0x54494d43         /* "CMIT". */
+
+/* The journal's descriptor, in sector JOURNAL_SECTOR.  A copy of
+   each logged sector follows it, in order. */
+struct journal_header
+  {
+    uint32_t magic;                     /* JOURNAL_MAGIC. */
+    uint32_t seq;                       /* Transaction's sequence number. */
+    uint32_t cnt;                       /* Number of sectors logged,
+                                           0 if there is nothing
+                                           to replay. */
+    block_sector_t sectors[JOURNAL_CAPACITY]; /* Their home sectors. */
+  };
+
+/* The commit record, in the sector after the last copy. */
+struct journal_commit
+  {
+    uint32_t magic;                     /* COMMIT_MAGIC. */
+    uint32_t seq;                       /* Same as the descriptor's. */
+    uint32_t checksum;                  /* Of home sectors and copies. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 12];
+  };
+
+/* A sector logged in the running transaction. */
+struct journal_block
+  {
+    struct hash_elem elem;              /* Element in blocks. */
+    block_sector_t sector;              /* Home sector. */
+    uint8_t *data;                      /* Contents saved by the cache,
+                                           or null if none yet. */
+  };
+
+static struct lock journal_lock;        /* Protects the variables below. */
+static struct hash blocks;              /* Running transaction's sectors. */
+static int outstanding;                 /* Operations in progress. */
+static size_t reserved;                 /* Sectors they may still log. */
+static bool committing;                 /* Commit keeping operations out? */
+static struct condition room;           /* An operation may begin. */
+static struct condition drained;        /* No operation in progress. */
+
+static struct lock commit_lock;         /* Serializes commits and owns
+                                           the variables below. */
+static uint32_t seq;                    /* Last transaction's number. */
+static struct journal_header header;
+static struct journal_commit commit_record;
+static struct journal_block *commit_blocks[JOURNAL_CAPACITY];
+static struct block_request requests[JOURNAL_CAPACITY + 1];
+
+static bool commit_pending;             /* commit_sema already up'd? */
+static struct semaphore commit_sema;    /* Wakes the journal thread. */
+
+static void journal_thread (void *);
+static void journal_recover (void);
+static hash_hash_func block_hash;
+static hash_less_func block_less;
+
+/* Initializes the journal.  If FORMAT is true, creates an empty
+   journal; otherwise replays the one on disk. */
+void
+journal_init (bool format)
+{
+  lock_init (&journal_lock);
+  if (!hash_init (&blocks, block_hash, block_less, NULL))
+    PANIC ("journal allocation failed");
+  outstanding = 0;
+  reserved = 0;
+  committing = false;
+  cond_init (&room);
+  cond_init (&drained);
+  lock_init (&commit_lock);
+  commit_pending = false;
+  sema_init (&commit_sema, 0);
+
+  if (free_map_sectors () + JOURNAL_OP_MAX > JOURNAL_CAPACITY)
+    PANIC ("file system device too large for the journal");
+
+  if (format)
+    {
+      memset (&header, 0, sizeof header);
+      header.magic = JOURNAL_MAGIC;
+      block_write (fs_device, JOURNAL_SECTOR, &header);
+      seq = 0;
+    }
+  else
+    journal_recover ();
+
+  thread_create ("journal", PRI_DEFAULT, journal_thread, NULL);
+}
+
+static unsigned
+block_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct journal_block *b = hash_entry (e, struct journal_block, elem);
+  return hash_int (b->sector);
+}
+
+static bool
+block_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  const struct journal_block *b_a = hash_entry (a, struct journal_block,
+                                                elem);
+  const struct journal_block *b_b = hash_entry (b, struct journal_block,
+                                                elem);
+  return b_a->sector < b_b->sector;
+}
+
+/* Returns the running transaction's block for SECTOR, or a null
+   pointer if SECTOR is not logged.  journal_lock must be held. */
+static struct journal_block *
+find_block (block_sector_t sector)
+{
+  struct journal_block key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&blocks, &key.elem);
+  return e != NULL ? hash_entry (e, struct journal_block, elem) : NULL;
+}
+
+/* Frees the journal_block containing E. */
+static void
+free_block (struct hash_elem *e, void *aux UNUSED)
+{
+  struct journal_block *b = hash_entry (e, struct journal_block, elem);
+  free (b->data);
+  free (b);
+}
+
+/* Folds the BLOCK_SECTOR_SIZE bytes at DATA into checksum SUM. */
+static uint32_t
+checksum_add (uint32_t sum, const void *data)
+{
+  return sum * 31 + hash_bytes (data, BLOCK_SECTOR_SIZE);
+}
+
+/* Replays the transaction in the journal, if it was committed,
+   and empties the journal. */
+static void
+journal_recover (void)
+{
+  uint8_t *copies;
+  uint32_t sum;
+
+  block_read (fs_device, JOURNAL_SECTOR, &header);
+  if (header.magic != JOURNAL_MAGIC)
+    PANIC ("no journal found--file system must be reformatted");
+  seq = header.seq;
+  if (header.cnt == 0)
+    return;
+
+  if (header.cnt > JOURNAL_CAPACITY)
+    goto done;
+  block_read (fs_device, JOURNAL_SECTOR + 1 + header.cnt, &commit_record);
+  if (commit_record.magic != COMMIT_MAGIC || commit_record.seq != header.seq)
+    goto done;
+
+  copies = malloc (header.cnt * BLOCK_SECTOR_SIZE);
+  if (copies == NULL)
+    PANIC ("journal recovery: out of memory");
+  sum = hash_bytes (header.sectors, header.cnt * sizeof *header.sectors);
+  for (size_t i = 0; i < header.cnt; i++)
+    {
+      block_read (fs_device, JOURNAL_SECTOR + 1 + i,
+                  copies + i * BLOCK_SECTOR_SIZE);
+      sum = checksum_add (sum, copies + i * BLOCK_SECTOR_SIZE);
+    }
+  if (sum == commit_record.checksum)
+    {
+      for (size_t i = 0; i < header.cnt; i++)
+        block_write (fs_device, header.sectors[i],
+                     copies + i * BLOCK_SECTOR_SIZE);
+      printf ("journal: replayed %zu sectors\n", (size_t) header.cnt);
+    }
+  free (copies);
+
+ done:
+  header.cnt = 0;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+}
+
+/* Completion function for the journal's asynchronous writes,
+   whose AUX is a semaphore counting completions. */
+static void
+journal_io_done (struct block_request *r)
+{
+  sema_up (r->aux);
+}
+
+/* Starts writing BUFFER to SECTOR with request R.  Ups DONE when
+   the write completes. */
+static void
+journal_submit (struct block_request *r, block_sector_t sector,
+                void *buffer, struct semaphore *done)
+{
+  r->write = true;
+  r->sector = sector;
+  r->cnt = 1;
+  r->buffer = buffer;
+  r->done = journal_io_done;
+  r->aux = done;
+  block_submit (fs_device, r);
+}
+
+static int
+compare_blocks (const void *a_, const void *b_)
+{
+  const struct journal_block *a = *(struct journal_block * const *) a_;
+  const struct journal_block *b = *(struct journal_block * const *) b_;
+
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Writes the CNT sectors in commit_blocks to the journal,
+   followed by the commit record. */
+static void
+write_log (size_t cnt)
+{
+  struct semaphore done;
+  uint32_t sum;
+
+  sema_init (&done, 0);
+  memset (&header, 0, sizeof header);
+  header.magic = JOURNAL_MAGIC;
+  header.seq = ++seq;
+  header.cnt = cnt;
+  for (size_t i = 0; i < cnt; i++)
+    header.sectors[i] = commit_blocks[i]->sector;
+  sum = hash_bytes (header.sectors, cnt * sizeof *header.sectors);
+
+  journal_submit (&requests[0], JOURNAL_SECTOR, &header, &done);
+  for (size_t i = 0; i < cnt; i++)
+    {
+      journal_submit (&requests[i + 1], JOURNAL_SECTOR + 1 + i,
+                      commit_blocks[i]->data, &done);
+      sum = checksum_add (sum, commit_blocks[i]->data);
+    }
+  for (size_t i = 0; i <= cnt; i++)
+    sema_down (&done);
+
+  memset (&commit_record, 0, sizeof commit_record);
+  commit_record.magic = COMMIT_MAGIC;
+  commit_record.seq = seq;
+  commit_record.checksum = sum;
+  block_write (fs_device, JOURNAL_SECTOR + 1 + cnt, &commit_record);
+}
+
+/* Writes the CNT sectors in commit_blocks home, then marks the
+   journal empty. */
+static void
+checkpoint (size_t cnt)
+{
+  struct semaphore done;
+
+  sema_init (&done, 0);
+  for (size_t i = 0; i < cnt; i++)
+    journal_submit (&requests[i], commit_blocks[i]->sector,
+                    commit_blocks[i]->data, &done);
+  for (size_t i = 0; i < cnt; i++)
+    sema_down (&done);
+
+  header.cnt = 0;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+}
+
+/* Waits for the operations in progress to end and commits the
+   running transaction, if it has logged anything. */
+static void
+journal_commit (void)
+{
+  struct hash_iterator i;
+  size_t cnt = 0;
+
+  lock_acquire (&commit_lock);
+  lock_acquire (&journal_lock);
+  if (hash_empty (&blocks))
+    {
+      lock_release (&journal_lock);
+      lock_release (&commit_lock);
+      return;
+    }
+  committing = true;
+  while (outstanding > 0)
+    cond_wait (&drained, &journal_lock);
+  lock_release (&journal_lock);
+
+  /* Logged sectors cannot change until committing is cleared, so
+     each is written to the journal in its state after some whole
+     number of operations. */
+  if (!hash_empty (&blocks))
+    {
+      cache_flush ();
+
+      lock_acquire (&journal_lock);
+      hash_first (&i, &blocks);
+      while (hash_next (&i))
+        {
+          struct journal_block *b = hash_entry (hash_cur (&i),
+                                                struct journal_block, elem);
+          ASSERT (b->data != NULL);
+          commit_blocks[cnt++] = b;
+        }
+      lock_release (&journal_lock);
+
+      /* Sorted, the home writes can be merged by the driver. */
+      qsort (commit_blocks, cnt, sizeof *commit_blocks, compare_blocks);
+      write_log (cnt);
+      checkpoint (cnt);
+      free_map_commit ();
+
+      lock_acquire (&journal_lock);
+      hash_clear (&blocks, free_block);
+      lock_release (&journal_lock);
+    }
+
+  lock_acquire (&journal_lock);
+  committing = false;
+  cond_broadcast (&room, &journal_lock);
+  lock_release (&journal_lock);
+  lock_release (&commit_lock);
+}
+
+/* Commits the running transaction.  Called at shutdown, after the
+   last operation. */
+void
+journal_done (void)
+{
+  journal_commit ();
+}
+
+/* Wakes the journal thread to commit the running transaction,
+   unless a wake-up is already pending. */
+void
+journal_wake (void)
+{
+  enum intr_level old_level = intr_disable ();
+  if (!commit_pending)
+    {
+      commit_pending = true;
+      sema_up (&commit_sema);
+    }
+  intr_set_level (old_level);
+}
+
+/* Journal thread.  Commits whenever woken by journal_wake(). */
+static void
+journal_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      sema_down (&commit_sema);
+      commit_pending = false;
+      journal_commit ();
+    }
+}
+
+/* Begins an operation that may log up to BUDGET sectors, waiting
+   until the running transaction has room for them and no commit
+   is under way.  Nested begins neither wait nor add to the
+   outermost one's budget. */
+static void
+begin (size_t budget)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (budget <= JOURNAL_CAPACITY);
+  if (t->journal_depth++ > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  while (committing
+         || hash_size (&blocks) + reserved + budget > JOURNAL_CAPACITY)
+    {
+      if (!committing)
+        journal_wake ();
+      cond_wait (&room, &journal_lock);
+    }
+  outstanding++;
+  reserved += budget;
+  t->journal_left = budget;
+  lock_release (&journal_lock);
+}
+
+/* Begins an operation that may modify metadata, dirtying up to
+   JOURNAL_OP_MAX sectors.  Operations nest: only the outermost
+   begin of a thread waits, and its transaction ends with the
+   matching journal_end().  Must not be called with any file
+   system lock held, unless nested. */
+void
+journal_begin (void)
+{
+  begin (JOURNAL_OP_MAX);
+}
+
+/* Like journal_begin(), but for an operation that may also dirty
+   every sector of the free map, such as removing a file, which
+   can release sectors anywhere on the disk, or formatting. */
+void
+journal_begin_large (void)
+{
+  begin (free_map_sectors () + JOURNAL_OP_MAX);
+}
+
+/* Ends the operation begun by the matching journal_begin(). */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  reserved -= t->journal_left;
+  t->journal_left = 0;
+  if (--outstanding == 0)
+    cond_signal (&drained, &journal_lock);
+  cond_broadcast (&room, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Logs SECTOR, which the cache has just marked dirty on behalf of
+   the running thread's operation, in the running transaction,
+   charging it to the operation's budget. */
+void
+journal_log (block_sector_t sector)
+{
+  struct thread *t = thread_current ();
+  struct journal_block *b;
+
+  lock_acquire (&journal_lock);
+  if (find_block (sector) == NULL)
+    {
+      if (t->journal_depth > 0)
+        {
+          /* An operation that needs more sectors than it asked
+             for must be split or begun as a large one. */
+          ASSERT (t->journal_left > 0);
+          t->journal_left--;
+          reserved--;
+        }
+      if (hash_size (&blocks) >= JOURNAL_CAPACITY)
+        PANIC ("journal overflow: more than %d sectors in a transaction",
+               JOURNAL_CAPACITY);
+      b = malloc (sizeof *b);
+      if (b == NULL)
+        PANIC ("journal allocation failed");
+      b->sector = sector;
+      b->data = NULL;
+      hash_insert (&blocks, &b->elem);
+    }
+  lock_release (&journal_lock);
+}
+
+/* Saves DATA, the BLOCK_SECTOR_SIZE-byte contents of logged
+   SECTOR, which the cache is writing back, until the running
+   transaction commits. */
+void
+journal_save (block_sector_t sector, const void *data)
+{
+  struct journal_block *b;
+
+  lock_acquire (&journal_lock);
+  b = find_block (sector);
+  ASSERT (b != NULL);
+  if (b->data == NULL)
+    {
+      b->data = malloc (BLOCK_SECTOR_SIZE);
+      if (b->data == NULL)
+        PANIC ("journal allocation failed");
+    }
+  memcpy (b->data, data, BLOCK_SECTOR_SIZE);
+  lock_release (&journal_lock);
+}
+
+/* If the running transaction holds saved contents for SECTOR,
+   copies them into DATA and returns true.  Otherwise returns
+   false, and SECTOR is current on disk. */
+bool
+journal_read (block_sector_t sector, void *data)
+{
+  struct journal_block *b;
+  bool found = false;
+
+  lock_acquire (&journal_lock);
+  b = find_block (sector);
+  if (b != NULL && b->data != NULL)
+    {
+      memcpy (data, b->data, BLOCK_SECTOR_SIZE);
+      found = true;
+    }
+  lock_release (&journal_lock);
+  return found;
+}
+
+/* Drops SECTOR, which has been freed, from the running
+   transaction.  Its contents no longer matter, and it must not be
+   written home over whatever it is reused for. */
+void
+journal_forget (block_sector_t sector)
+{
+  struct journal_block *b;
+
+  lock_acquire (&journal_lock);
+  b = find_block (sector);
+  if (b != NULL)
+    {
+      hash_delete (&blocks, &b->elem);
+      free_block (&b->elem, NULL);
+    }
+  lock_release (&journal_lock);
+}
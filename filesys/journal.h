@@ -0,0 +1,33 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Most metadata sectors one transaction can hold: as many sector
+   numbers as fit in the journal's descriptor sector. */
+#define JOURNAL_CAPACITY 125
+
+/* Sectors reserved for the journal, starting at JOURNAL_SECTOR:
+   the descriptor, a copy of each logged sector, and the commit
+   record. */
+#define JOURNAL_SECTORS (JOURNAL_CAPACITY + 2)
+
+/* Most distinct metadata sectors an operation begun by
+   journal_begin() may dirty. */
+#define JOURNAL_OP_MAX 32
+
+void journal_init (bool format);
+void journal_done (void);
+void journal_begin (void);
+void journal_begin_large (void);
+void journal_end (void);
+void journal_wake (void);
+
+/* Interface for the buffer cache. */
+void journal_log (block_sector_t);
+void journal_save (block_sector_t, const void *);
+bool journal_read (block_sector_t, void *);
+void journal_forget (block_sector_t);
+
+#endif /* filesys/journal.h */
@@ -0,0 +1,18 @@
+#ifndef __LIB_DIRENT_H
+#define __LIB_DIRENT_H
+
+#include <stdbool.h>
+
+/* Maximum length of a name in a struct dirent, which is the file
+   system's maximum file name length. */
+#define DIRENT_NAME_MAX 14
+
+/* A directory entry, as returned by the getdents system call. */
+struct dirent
+  {
+    int inumber;                        /* Inode number. */
+    bool isdir;                         /* Is it a directory? */
+    char name[DIRENT_NAME_MAX + 1];     /* Null terminated name. */
+  };
+
+#endif /* lib/dirent.h */
@@ -38,6 +38,7 @@
 #include "devices/ide.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/cache.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -254,6 +255,12 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache-sectors"))
+        cache_sector_cnt = atoi (value);
+      else if (!strcmp (name, "-cache-flush"))
+        cache_flush_ms = atoi (value);
+      else if (!strcmp (name, "-dma"))
+        ide_dma = true;
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -266,6 +273,10 @@ parse_options (char **argv)
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
+      else if (!strcmp (name, "-pageout-low"))
+        frame_low_water = atoi (value);
+      else if (!strcmp (name, "-pageout-high"))
+        frame_high_water = atoi (value);
 #endif
       else
         PANIC ("unknown option `%s' (use -h for help)", name);
@@ -380,6 +391,9 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache-sectors=N   Hold N sectors in the buffer cache.\n"
+          "  -cache-flush=MS    Write back dirty sectors every MS ms.\n"
+          "  -dma               Use bus-master DMA for IDE disks.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -388,6 +402,8 @@ usage (void)
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
+          "  -pageout-low=N     Page out when fewer than N user pages are free.\n"
+          "  -pageout-high=N    Page out until N user pages are free.\n"
 #endif
           );
   shutdown_power_off ();
@@ -128,6 +128,13 @@ struct thread
 
 #endif
 
+#ifdef FILESYS
+    /* Owned by filesys/journal.c. */
+    int journal_depth;                  /* Nesting of journal operations. */
+    size_t journal_left;                /* Sectors the outermost one may
+                                           still log. */
+#endif
+
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
   };
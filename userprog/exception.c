@@ -142,14 +142,14 @@ lazy_load (void *fault_addr, struct thread *t)
     bool writable = execpage_entry_ptr->writable;
 
     //acquire_filesys_lock ();
-    acquire_frame_lock ();
-
     file_seek (file, ofs);
 
     /* Get a page of memory. */
     struct frame_table_entry *fte = frame_alloc (PAL_USER);
+    if (fte == NULL)
+      return NULL;
+    acquire_frame_lock ();
     success = allocate_page (upage, fte, writable);
-
     release_frame_lock ();
 
 
@@ -236,6 +236,10 @@ page_fault (struct intr_frame *f)
   if (not_present && fault_addr != NULL && is_user_vaddr (fault_addr))
   {
       struct frame_table_entry *fte = page_fault_handler (f, fault_addr);
+
+      /* Out of swap: the process cannot be given the page. */
+      if (fte == NULL)
+        exit (-1);
       lock_release (&fte->lock);
   }
 
@@ -247,6 +251,9 @@ page_fault (struct intr_frame *f)
 }
 
 
+/* Brings in the page of the running thread containing FAULT_ADDR
+   and returns its frame with its lock held, or a null pointer if
+   no frame is available because swap is full. */
 struct frame_table_entry *
 page_fault_handler (struct intr_frame *f, void *fault_addr)
 {
@@ -257,18 +264,28 @@ page_fault_handler (struct intr_frame *f, void *fault_addr)
   struct thread *t = thread_current ();
   struct frame_table_entry *fte;
 
-  if ( (SPT_entry_ptr = SPT_lookup (&t->SPT, fault_addr)) != NULL )
+  /* Wait out any eviction of the page.  A clean page of the
+     executable that was dropped is loaded again from scratch. */
+  acquire_frame_lock ();
+  SPT_entry_ptr = SPT_lookup (&t->SPT, fault_addr);
+  if (SPT_entry_ptr != NULL)
+    frame_wait_eviction (SPT_entry_ptr);
+  if (SPT_entry_ptr != NULL && !SPT_entry_ptr->evicted
+      && !SPT_entry_ptr->is_mmap && SPT_entry_ptr->frame == NULL)
+  {
+    SPT_remove (SPT_entry_ptr, t);
+    SPT_entry_ptr = NULL;
+  }
+  release_frame_lock ();
+
+  if (SPT_entry_ptr != NULL)
   {
     /* Page Reclaimation. */
     if (SPT_entry_ptr->evicted)
     {
       void *upage = pg_round_down (fault_addr);
 
-      acquire_frame_lock ();
-      fte = frame_alloc (PAL_USER | PAL_ZERO);
-      swap_in (fte, SPT_entry_ptr->index);
-      reclaim_page (SPT_entry_ptr, upage, fte);
-      release_frame_lock ();
+      fte = frame_swap_in (SPT_entry_ptr, upage);
     }
 
     else if (SPT_entry_ptr->is_mmap)
@@ -276,11 +293,12 @@ page_fault_handler (struct intr_frame *f, void *fault_addr)
       //printf ("loading\n");
       void *upage = pg_round_down (fault_addr);
 
-      acquire_frame_lock();
       fte = frame_alloc (PAL_USER | PAL_ZERO);
+      if (fte == NULL)
+        return NULL;
       //printf ("fteframe %p\n", fte->frame);
+      acquire_frame_lock ();
       reclaim_page (SPT_entry_ptr, upage, fte);
-
       release_frame_lock ();
 
       void *kpage = fte->frame;
@@ -311,10 +329,12 @@ page_fault_handler (struct intr_frame *f, void *fault_addr)
   {
       void *upage = pg_round_down (fault_addr);
 
-      acquire_frame_lock ();
       fte = frame_alloc (PAL_USER | PAL_ZERO);
+      if (fte == NULL)
+        return NULL;
 
       writable = true;
+      acquire_frame_lock ();
       success = allocate_page (upage, fte, writable);
       release_frame_lock ();
 
@@ -327,7 +347,6 @@ page_fault_handler (struct intr_frame *f, void *fault_addr)
     /* Lazy Executable Loading. */
     //printf ("lazy1\n");
     fte = lazy_load (fault_addr, t);
-    ASSERT (fte != NULL);
   }
 
   return fte;
@@ -529,8 +529,10 @@ setup_stack (void **esp, const char *filename, char *args)
   uint8_t *upage = ((uint8_t *) PHYS_BASE) - PGSIZE;
   bool success = false;
 
-  acquire_frame_lock ();
   fte = frame_alloc (PAL_USER | PAL_ZERO);
+  if (fte == NULL)
+    return false;
+  acquire_frame_lock ();
   success = allocate_page (upage, fte, true);
   release_frame_lock ();
 
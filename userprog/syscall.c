@@ -163,7 +163,7 @@ syscall_handler (struct intr_frame *f)
       unsigned size = *((unsigned*)f->esp + 3);
 
       // lock_acquire (&filesys_lock);
-      f->eax = write (fd, buffer, size);
+      f->eax = write (fd, buffer, size, f);
       // lock_release (&filesys_lock);
 
       break;
@@ -282,6 +282,18 @@ syscall_handler (struct intr_frame *f)
       break;
     }
 
+    case SYS_GETDENTS:
+    {
+      validate3 (f->esp);
+
+      int fd = *((int*)f->esp + 1);
+      struct dirent *entries = (struct dirent*)*((int*)f->esp + 2);
+      unsigned cnt = *((unsigned*)f->esp + 3);
+
+      f->eax = getdents (fd, entries, cnt, f);
+      break;
+    }
+
     default:
     {
       ASSERT (0);
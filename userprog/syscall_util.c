@@ -11,6 +11,7 @@
 #include "filesys/directory.h"
 #include "filesys/inode.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include <console.h>
 #include <debug.h>
 #include "devices/input.h"
@@ -25,6 +26,7 @@
 struct file * fd_to_file (int fd);
 struct mmap_entry *mapid_to_mmap_entry (int mapping);
 static struct dir *checkdir (char *dir_copy, char **token);
+static void unpin_and_exit (struct frame_table_entry **, int cnt);
 
 void halt (void)
 {
@@ -171,7 +173,6 @@ int read (int fd, void *buffer, unsigned size, struct intr_frame *f)
 {
   validate (buffer);
 
-  struct thread *t = thread_current ();
   int ret;
 
   if (fd == 0)
@@ -200,20 +201,13 @@ int read (int fd, void *buffer, unsigned size, struct intr_frame *f)
 
   for (int i = 0; i < len; i++)
   {
-    acquire_frame_lock ();
-    void *frame = pagedir_get_page (t->pagedir, pg_round_down (buffer) + i * PGSIZE);
-    if (frame == NULL)
-    {
-      release_frame_lock ();
-      fte[i] = page_fault_handler (f, pg_round_down (buffer) + i * PGSIZE);
-    }
-    else
-    {
-      fte[i] = fte_lookup (frame);
-      ASSERT (fte[i]->owner == t);
-      lock_acquire (&fte[i]->lock);
-      release_frame_lock ();
-    }
+    void *upage = pg_round_down (buffer) + i * PGSIZE;
+
+    fte[i] = frame_pin (upage);
+    if (fte[i] == NULL)
+      fte[i] = page_fault_handler (f, upage);
+    if (fte[i] == NULL)
+      unpin_and_exit (fte, i);
   }
 
   //acquire_filesys_lock ();
@@ -231,11 +225,10 @@ int read (int fd, void *buffer, unsigned size, struct intr_frame *f)
   return ret;
 }
 
-int write (int fd, void *buffer, unsigned size)
+int write (int fd, void *buffer, unsigned size, struct intr_frame *f)
 {
   validate (buffer);
 
-  struct thread *t = thread_current ();
   int ret;
 
   if (fd == 1)
@@ -260,17 +253,13 @@ int write (int fd, void *buffer, unsigned size)
 
   for (int i = 0; i < len; i++)
   {
-    acquire_frame_lock ();
-    void *frame = pagedir_get_page (t->pagedir, pg_round_down (buffer) + i * PGSIZE);
-    if (frame == NULL)
-      exit (-1);
-    else
-    {
-      fte[i] = fte_lookup (frame);
-      ASSERT (fte[i]->owner == t);
-      lock_acquire (&fte[i]->lock);
-      release_frame_lock ();
-    }
+    /* The page may have been evicted since validate() touched
+       it. */
+    fte[i] = frame_pin (pg_round_down (buffer) + i * PGSIZE);
+    if (fte[i] == NULL)
+      fte[i] = page_fault_handler (f, pg_round_down (buffer) + i * PGSIZE);
+    if (fte[i] == NULL)
+      unpin_and_exit (fte, i);
   }
 
   //acquire_filesys_lock ();
@@ -385,17 +374,15 @@ void munmap (int mapping)
   {
     struct SPT_entry *spte = SPT_lookup (&cur->SPT, addr);
 
-    // some may not be lazy loaded yet
-    if (pagedir_is_dirty (cur->pagedir, spte->page))
+    // some may not be lazy loaded yet, or evicted
+    struct frame_table_entry *fte = frame_pin (addr);
+    if (fte != NULL)
     {
+      if (pagedir_is_dirty (cur->pagedir, spte->page))
+        file_write_at (spte->mmap_file, spte->frame, spte->mmap_read_bytes, spte->mmap_offset);
       acquire_frame_lock ();
-      struct frame_table_entry *fte = fte_lookup (spte->frame);
-      ASSERT (spte != NULL && fte != NULL);
-      lock_acquire (&fte->lock);
-      release_frame_lock ();
-
-      file_write_at (spte->mmap_file, spte->frame, spte->mmap_read_bytes, spte->mmap_offset);
       frame_remove (fte);
+      release_frame_lock ();
     }
 
 
@@ -453,6 +440,18 @@ checkdir (char *dir_copy, char **token)
       return temp_dir;
 }
 
+/* Releases the first CNT frames in FTE, which read(), write() or
+   getdents() pinned, frees FTE and kills the process, for which swap has no
+   room to page in the rest of its buffer. */
+static void
+unpin_and_exit (struct frame_table_entry **fte, int cnt)
+{
+  for (int i = 0; i < cnt; i++)
+    lock_release (&fte[i]->lock);
+  free (fte);
+  exit (-1);
+}
+
 bool
 chdir (const char *dir)
 {
@@ -521,13 +520,15 @@ mkdir (const char *dir)
     goto done;
   }
 
+  journal_begin ();
   success = (free_map_allocate (&inode_sector)
               && dir_create (inode_sector, 0, checkeddir)
               && dir_add (checkeddir, dirname, inode_sector));
+  if (!success && inode_sector != 0)
+    free_map_release (inode_sector, 1);
+  journal_end ();
 
   done:
-    if (!success && inode_sector != 0)
-      free_map_release (inode_sector);
     free (dir_copy);
     dir_close (checkeddir);
     return success;
@@ -547,18 +548,100 @@ readdir (int fd, char *name)
   if (inode_emptydir (inode))
     return false;
 
-  struct dir_entry e;
+  off_t pos = file_tell (file);
+  bool success = dir_read_next (inode, &pos, name);
+  file_seek (file, pos);
 
-  while (file_read (file, &e, sizeof e) == sizeof e)
-    {
-      if (e.in_use && strcmp (e.name, ".") != 0 && strcmp (e.name, "..") != 0)
-        {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
-        }
-    }
+  return success;
+}
+
+/* Reads up to CNT entries, other than "." and "..", from the
+   directory open as FD into ENTRIES, continuing where the last
+   readdir or getdents on FD stopped.  Returns the number of
+   entries read, 0 at the end of the directory, or -1 if FD is not
+   an open directory or the kernel is out of memory.  At most
+   GETDENTS_MAX entries are returned per call. */
+int
+getdents (int fd, struct dirent *entries, unsigned cnt, struct intr_frame *f)
+{
+  struct file *file = fd_to_file (fd);
+  struct frame_table_entry **fte;
+  struct dir_entry *batch;
+  struct dirent *out;
+  bool *isdir;
+  off_t pos;
+  size_t n;
+  int len;
+  int ret = -1;
+
+  if (file == NULL || !inode_isdir (file_get_inode (file)))
+    return -1;
+  if (cnt > GETDENTS_MAX)
+    cnt = GETDENTS_MAX;
+  if (cnt == 0)
+    return 0;
+  validate (entries);
+  validate ((uint8_t *) (entries + cnt) - 4);
+
+  /* Touch each of ENTRIES' pages for writing before allocating
+     anything, so that a page the process may not write kills it
+     here, with nothing to free.  Then pin the pages, so that the
+     copy out below cannot fault. */
+  len = (pg_round_up (entries + cnt) - pg_round_down (entries)) / PGSIZE;
+  for (int i = 0; i < len; i++)
+  {
+    volatile uint8_t *p = i == 0 ? (uint8_t *) entries
+                                 : pg_round_down (entries) + i * PGSIZE;
+    *p = *p;
+  }
+  fte = calloc (sizeof (struct frame_table_entry *), len);
+  if (fte == NULL)
+    return -1;
+  for (int i = 0; i < len; i++)
+  {
+    void *upage = pg_round_down (entries) + i * PGSIZE;
 
-  return false;
+    fte[i] = frame_pin (upage);
+    if (fte[i] == NULL)
+      fte[i] = page_fault_handler (f, upage);
+    if (fte[i] == NULL)
+      unpin_and_exit (fte, i);
+  }
+
+  batch = malloc (cnt * sizeof *batch);
+  out = malloc (cnt * sizeof *out);
+  isdir = malloc (cnt * sizeof *isdir);
+  if (batch == NULL || out == NULL || isdir == NULL)
+  {
+    free (isdir);
+    free (out);
+    free (batch);
+    goto done;
+  }
+
+  pos = file_tell (file);
+  n = dir_read_entries (file_get_inode (file), &pos, batch, isdir, cnt);
+  file_seek (file, pos);
+
+  for (size_t i = 0; i < n; i++)
+  {
+    out[i].inumber = batch[i].inode_sector;
+    out[i].isdir = isdir[i];
+    strlcpy (out[i].name, batch[i].name, sizeof out[i].name);
+  }
+
+  memcpy (entries, out, n * sizeof *out);
+
+  free (isdir);
+  free (out);
+  free (batch);
+  ret = n;
+
+  done:
+    for (int i = 0; i < len; i++)
+      lock_release (&fte[i]->lock);
+    free (fte);
+    return ret;
 }
 
 bool
@@ -4,6 +4,10 @@
 #include "threads/thread.h"
 #include "userprog/process.h"
 #include "threads/interrupt.h"
+#include <dirent.h>
+
+/* Most entries returned by one getdents call. */
+#define GETDENTS_MAX 64
 
 void halt (void);
 void exit (int);
@@ -14,7 +18,7 @@ bool remove (const char *);
 int open (const char *);
 int filesize (int);
 int read (int, void *, unsigned, struct intr_frame *);
-int write (int, void *, unsigned);
+int write (int, void *, unsigned, struct intr_frame *);
 void seek (int, unsigned);
 unsigned tell (int);
 void close (int);
@@ -25,6 +29,7 @@ bool mkdir (const char *);
 bool readdir (int, char *);
 bool isdir (int);
 int inumber (int);
+int getdents (int, struct dirent *, unsigned, struct intr_frame *);
 
 
 void validate_sp (void *);
@@ -1,35 +1,35 @@
 #include <stdio.h>
+#include <string.h>
 #include "vm/frame.h"
 #include "threads/malloc.h"
 #include "threads/thread.h"
+#include "threads/vaddr.h"
 #include "userprog/pagedir.h"
 #include "userprog/syscall.h"
 #include "vm/swap.h"
 #include "threads/synch.h"
 
-static struct hash frame_table;
-static void *global_frame;
-static struct lock frame_lock;
+static struct frame_table_entry *frame_table; /* frame_cnt entries. */
+static size_t frame_cnt;        /* Pages in the user pool. */
+static uint8_t *user_base;      /* First page of the user pool. */
+static size_t clock_hand;       /* Next entry choose_victim() examines. */
+static size_t used_cnt;         /* Entries in use. */
 
+size_t frame_low_water = FRAME_DEFAULT_LOW_WATER;
+size_t frame_high_water = FRAME_DEFAULT_HIGH_WATER;
 
-unsigned hash_swan_func (const struct hash_elem *elem, void *aux UNUSED);
-bool less_func (const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED);
+static bool pageout_pending;            /* pageout_sema already up'd? */
+static struct semaphore pageout_sema;   /* Wakes the page-out daemon. */
 
+static void page_out (void *);
+static struct frame_table_entry *clock_sweep (size_t steps);
 
-unsigned
-hash_swan_func (const struct hash_elem *elem, void *aux UNUSED)
-{
-  struct frame_table_entry *fte = hash_entry(elem, struct frame_table_entry, elem);
-  return hash_bytes(&fte->frame, sizeof(fte->frame));
-}
-
-bool
-less_func (const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
-{
-  struct frame_table_entry *fte_a = hash_entry(a, struct frame_table_entry, elem);
-  struct frame_table_entry *fte_b = hash_entry(b, struct frame_table_entry, elem);
-  return fte_a->frame < fte_b->frame;
-}
+/* Protects frame_table's in_use, owner and aux, clock_hand, user
+   page mappings, and the residency of supplemental page table
+   entries.  Held only briefly, never across disk I/O: a frame's
+   own lock pins its contents while they are read or written. */
+static struct lock frame_lock;
+static struct condition eviction_done; /* An eviction finished. */
 
 void acquire_frame_lock (void)
 {
@@ -44,9 +44,37 @@ void release_frame_lock (void)
 void
 frame_table_init (void)
 {
-  hash_init (&frame_table, hash_swan_func, less_func, NULL);
-  //global_frame = NULL;
+  user_base = palloc_user_base ();
+  frame_cnt = palloc_user_page_cnt ();
+  frame_table = calloc (frame_cnt, sizeof *frame_table);
+  if (frame_table == NULL)
+    PANIC ("Cannot allocate frame table");
+
+  for (size_t i = 0; i < frame_cnt; i++)
+  {
+    frame_table[i].frame = user_base + i * PGSIZE;
+    lock_init (&frame_table[i].lock);
+  }
+  clock_hand = 0;
+  used_cnt = 0;
   lock_init (&frame_lock);
+  cond_init (&eviction_done);
+
+  /* Leave the daemon at least half of memory to work with. */
+  if (frame_high_water > frame_cnt / 2)
+    frame_high_water = frame_cnt / 2;
+  if (frame_low_water > frame_high_water)
+    frame_low_water = frame_high_water;
+  pageout_pending = false;
+  sema_init (&pageout_sema, 0);
+  thread_create ("page-out", PRI_DEFAULT, page_out, NULL);
+}
+
+/* Returns the index in frame_table of user pool page FRAME. */
+static size_t
+frame_index (void *frame)
+{
+  return pg_no (frame) - pg_no (user_base);
 }
 
 struct frame_table_entry *
@@ -54,79 +82,425 @@ fte_lookup (void *frame)
 {
   ASSERT (frame != NULL);
 
-  struct frame_table_entry fte;
-  struct frame_table_entry* ret;
-  struct hash_elem *elem;
-
-  fte.frame = frame;
-  elem = hash_find (&frame_table, &fte.elem);
+  size_t idx = frame_index (frame);
 
-  if (elem != NULL)
-  {
-    ret = hash_entry (elem, struct frame_table_entry, elem);
-    return ret;
-  }
+  if (idx < frame_cnt && frame_table[idx].in_use)
+    return &frame_table[idx];
   else
-  {
     return NULL;
-  }
 }
 
+/* Returns the frame of FTE, whose lock must be held, to the user
+   pool and releases the lock.  frame_lock must be held. */
+static void
+free_frame (struct frame_table_entry *fte)
+{
+  fte->in_use = false;
+  fte->owner = NULL;
+  fte->aux = NULL;
+  used_cnt--;
+  palloc_free_page (fte->frame);
+  lock_release (&fte->lock);
+}
+
+/* Unmaps and frees the frame of FTE, whose lock must be held,
+   and releases the lock.  frame_lock must be held. */
 void
 frame_remove (struct frame_table_entry *fte)
 {
   ASSERT (fte != NULL);
+  ASSERT (lock_held_by_current_thread (&frame_lock));
   pagedir_clear_page (fte->owner->pagedir, fte->aux->page);
-  hash_delete (&frame_table, &fte->elem);
-  palloc_free_page (fte->frame);
-  lock_release (&fte->lock);
-  free (fte);
+  free_frame (fte);
 }
 
-struct frame_table_entry *
-frame_alloc (enum palloc_flags flags)
+/* Wakes the page-out daemon if fewer than frame_low_water frames
+   are free, unless a wake-up is already pending.  frame_lock must
+   be held. */
+static void
+wake_page_out (void)
+{
+  if (frame_cnt - used_cnt < frame_low_water && !pageout_pending)
+  {
+    pageout_pending = true;
+    sema_up (&pageout_sema);
+  }
+}
+
+/* Waits until SPTE's page is not being evicted.  frame_lock must
+   be held; it is released while waiting. */
+void
+frame_wait_eviction (struct SPT_entry *spte)
+{
+  while (spte->evicting)
+    cond_wait (&eviction_done, &frame_lock);
+}
+
+/* If user page UPAGE of T is resident, dirty, not accessed since
+   the clock hand last passed it, not mmapped and not pinned,
+   unmaps it, marks it as being evicted and returns its frame with
+   the frame's lock held.  Otherwise returns a null pointer.
+   frame_lock must be held. */
+static struct frame_table_entry *
+take_neighbor (struct thread *t, uint8_t *upage)
+{
+  struct frame_table_entry *fte;
+  void *frame;
+
+  if (upage == NULL || !is_user_vaddr (upage))
+    return NULL;
+  frame = pagedir_get_page (t->pagedir, upage);
+  if (frame == NULL)
+    return NULL;
+  fte = fte_lookup (frame);
+  if (fte == NULL || fte->aux == NULL || fte->aux->is_mmap
+      || !pagedir_is_dirty (t->pagedir, upage)
+      || pagedir_is_accessed (t->pagedir, upage)
+      || !lock_try_acquire (&fte->lock))
+    return NULL;
+
+  pagedir_clear_page (t->pagedir, upage);
+  fte->aux->evicting = true;
+  return fte;
+}
+
+/* Stores in CLUSTER, in address order, FTE's page and the run of
+   virtually adjacent pages around it that take_neighbor() can
+   claim, up to SWAP_CLUSTER pages in all, so that they go to swap
+   together.  Returns the number of pages stored.  frame_lock must
+   be held. */
+static size_t
+gather_cluster (struct frame_table_entry *fte,
+                struct frame_table_entry **cluster)
+{
+  struct thread *t = fte->owner;
+  uint8_t *upage = fte->aux->page;
+  struct frame_table_entry *below[SWAP_CLUSTER];
+  size_t below_cnt = 0;
+  size_t cnt = 0;
+
+  /* Pages below first, so that a linear walk upward, which evicts
+     its oldest pages first, still gets whole clusters. */
+  while (below_cnt + 1 < SWAP_CLUSTER)
+  {
+    struct frame_table_entry *n
+      = take_neighbor (t, upage - (below_cnt + 1) * PGSIZE);
+    if (n == NULL)
+      break;
+    below[below_cnt++] = n;
+  }
+  while (below_cnt > 0)
+    cluster[cnt++] = below[--below_cnt];
+  cluster[cnt++] = fte;
+
+  while (cnt < SWAP_CLUSTER)
+  {
+    struct frame_table_entry *n
+      = take_neighbor (t, upage + (cnt - below_cnt) * PGSIZE);
+    if (n == NULL)
+      break;
+    cluster[cnt++] = n;
+  }
+  return cnt;
+}
+
+/* Maps the dirty page in FTE, unmapped by evict(), again as it
+   was.  frame_lock must be held. */
+static void
+remap (struct frame_table_entry *fte)
 {
-  struct frame_table_entry *to_evict;
-  struct frame_table_entry *new = calloc (sizeof (struct frame_table_entry), 1);
+  struct SPT_entry *spte = fte->aux;
+
+  if (!pagedir_set_page (fte->owner->pagedir, spte->page, fte->frame,
+                         spte->writable))
+    PANIC ("Cannot map page again after swap ran out");
+  pagedir_set_dirty (fte->owner->pagedir, spte->page, true);
+}
 
-  if (new == NULL)
-    PANIC ("Cannot allocate frame");
+/* Gives back N, a neighbour that take_neighbor() claimed for a
+   cluster that swap has no room for, mapping its page again and
+   releasing its lock.  frame_lock must be held; the caller must
+   broadcast eviction_done. */
+static void
+release_neighbor (struct frame_table_entry *n)
+{
+  remap (n);
+  n->aux->evicting = false;
+  lock_release (&n->lock);
+}
 
-  new->frame = palloc_get_page (flags);
+/* Evicts the page held by FTE, which clock_sweep() chose and
+   unmapped, leaving the frame in use and its lock held.  Since the
+   page is unmapped, its owner faults and waits in
+   frame_wait_eviction() if it touches the page again.  The page is
+   written out with frame_lock released: mmapped pages to their
+   file, dirty pages to swap.  A clean page of the executable is
+   simply dropped, to be reloaded on its next fault.
+
+   A dirty page goes to swap together with the cold, dirty pages
+   next to it in its process's address space, in one I/O to
+   consecutive slots; their frames are returned to the user
+   pool.  If swap has too few free slots for the whole cluster, the
+   neighbours farthest from FTE's page are given back until it
+   fits.  If swap has no room even for FTE's page alone, the page is
+   mapped again as it was, FTE's lock is released and false is
+   returned. */
+static bool
+evict (struct frame_table_entry *fte)
+{
+  struct SPT_entry *spte = fte->aux;
+  struct frame_table_entry *cluster[SWAP_CLUSTER];
+  size_t cnt = 0;
+  bool dirty = fte->dirty;
+  bool swapped = true;
 
-  // Swap out.
-  if (new->frame == NULL)
+  if (!spte->is_mmap && dirty)
   {
-    to_evict = choose_victim ();
+    lock_acquire (&frame_lock);
+    cnt = gather_cluster (fte, cluster);
+    lock_release (&frame_lock);
+  }
 
-    if (to_evict->aux->is_mmap)
+  if (spte->is_mmap)
+    file_write_at (spte->mmap_file, fte->frame, spte->mmap_read_bytes,
+                   spte->mmap_offset);
+  else if (dirty)
+    while (!(swapped = swap_out_cluster (cluster, cnt)) && cnt > 1)
     {
-      struct SPT_entry *spte = to_evict->aux;
-      file_write_at (spte->mmap_file, spte->frame, spte->mmap_read_bytes, spte->mmap_offset);
-      frame_remove(to_evict);
+      size_t v = 0;
+
+      while (cluster[v] != fte)
+        v++;
+      lock_acquire (&frame_lock);
+      if (cnt - 1 - v >= v)
+        release_neighbor (cluster[--cnt]);
+      else
+      {
+        release_neighbor (cluster[0]);
+        memmove (cluster, cluster + 1, --cnt * sizeof *cluster);
+      }
+      cond_broadcast (&eviction_done, &frame_lock);
+      lock_release (&frame_lock);
     }
 
-    else if (pagedir_is_dirty (to_evict->owner->pagedir, to_evict->aux->page))
+  lock_acquire (&frame_lock);
+  if (!spte->is_mmap && !dirty)
+    spte->frame = NULL;
+  if (swapped)
+  {
+    for (size_t i = 0; i < cnt; i++)
+      if (cluster[i] != fte)
+      {
+        cluster[i]->aux->evicting = false;
+        free_frame (cluster[i]);
+      }
+    fte->aux = NULL;
+  }
+  else
+  {
+    remap (fte);
+    lock_release (&fte->lock);
+  }
+  spte->evicting = false;
+  cond_broadcast (&eviction_done, &frame_lock);
+  lock_release (&frame_lock);
+  return swapped;
+}
+
+/* Claims user pool page FRAME, just returned by palloc_get_page(),
+   for the running thread and returns its entry with its lock held.
+   frame_lock must be held. */
+static struct frame_table_entry *
+take_frame (void *frame)
+{
+  struct frame_table_entry *fte = &frame_table[frame_index (frame)];
+
+  ASSERT (!fte->in_use);
+  lock_acquire (&fte->lock);
+  fte->in_use = true;
+  fte->owner = thread_current ();
+  fte->aux = NULL;
+  used_cnt++;
+  wake_page_out ();
+  return fte;
+}
+
+/* Returns a frame for the running thread with its lock held,
+   evicting a page if the user pool is empty, or a null pointer if
+   no page can be evicted because swap is full.  The caller must
+   not hold frame_lock, and must map the frame with allocate_page()
+   or reclaim_page() while holding frame_lock. */
+struct frame_table_entry *
+frame_alloc (enum palloc_flags flags)
+{
+  struct frame_table_entry *fte;
+  void *frame = palloc_get_page (flags);
+
+  if (frame == NULL)
+  {
+    size_t tries;
+
+    /* The daemon has fallen behind.  Take a victim's frame over
+       once its page is out.  With swap full, only a page that
+       need not go to swap will do, so give each frame a try. */
+    for (tries = 0; tries < frame_cnt; tries++)
     {
-      swap_out (to_evict);
-      frame_remove (to_evict);
+      lock_acquire (&frame_lock);
+      wake_page_out ();
+      fte = choose_victim ();
+      lock_release (&frame_lock);
+
+      if (evict (fte))
+        break;
     }
-    else
+    if (tries == frame_cnt)
+      return NULL;
+
+    if (flags & PAL_ZERO)
+      memset (fte->frame, 0, PGSIZE);
+
+    lock_acquire (&frame_lock);
+    fte->owner = thread_current ();
+    lock_release (&frame_lock);
+    return fte;
+  }
+
+  lock_acquire (&frame_lock);
+  fte = take_frame (frame);
+  lock_release (&frame_lock);
+
+  return fte;
+}
+
+/* Brings swapped-out page UPAGE of the running thread, described
+   by SPTE, back into memory and returns its frame with its lock
+   held.  The pages after UPAGE that were swapped out in the same
+   cluster, and so occupy the following slots, are read ahead by
+   the same I/O as long as free frames are at hand for them; they
+   are mapped unaccessed, so the clock evicts them first if they
+   go unused.  Returns a null pointer if no frame can be had
+   because swap is full.  The caller must not hold frame_lock. */
+struct frame_table_entry *
+frame_swap_in (struct SPT_entry *spte, void *upage)
+{
+  struct thread *t = thread_current ();
+  struct frame_table_entry *ftes[SWAP_CLUSTER];
+  struct SPT_entry *sptes[SWAP_CLUSTER];
+  size_t index = spte->index;
+  size_t cnt;
+
+  ftes[0] = frame_alloc (PAL_USER);
+  if (ftes[0] == NULL)
+    return NULL;
+  sptes[0] = spte;
+
+  lock_acquire (&frame_lock);
+  for (cnt = 1; cnt < SWAP_CLUSTER; cnt++)
+  {
+    uint8_t *next = (uint8_t *) upage + cnt * PGSIZE;
+    struct SPT_entry *s;
+    void *frame;
+
+    if (!is_user_vaddr (next) || frame_cnt - used_cnt <= frame_low_water)
+      break;
+    s = SPT_lookup (&t->SPT, next);
+    if (s == NULL || !s->evicted || s->evicting
+        || s->index != index + cnt)
+      break;
+    frame = palloc_get_page (PAL_USER);
+    if (frame == NULL)
+      break;
+    ftes[cnt] = take_frame (frame);
+    sptes[cnt] = s;
+  }
+  lock_release (&frame_lock);
+
+  swap_in_cluster (ftes, cnt, index);
+
+  lock_acquire (&frame_lock);
+  for (size_t i = 0; i < cnt; i++)
+  {
+    void *page = (uint8_t *) upage + i * PGSIZE;
+    reclaim_page (sptes[i], page, ftes[i]);
+
+    /* The swap slot is gone, so the page must be written out
+       again if it is evicted. */
+    pagedir_set_dirty (t->pagedir, page, true);
+    if (i > 0)
     {
-      struct SPT_entry *SPT_entry = to_evict->aux;
-      struct thread *t = to_evict->owner;
-      frame_remove (to_evict);
-      SPT_remove (SPT_entry, t);
+      pagedir_set_accessed (t->pagedir, page, false);
+      lock_release (&ftes[i]->lock);
     }
-    new->frame = palloc_get_page (flags);
   }
+  lock_release (&frame_lock);
 
-  new->owner = thread_current ();
-  lock_init (&new->lock);
-  lock_acquire(&new->lock);
-  hash_insert (&frame_table, &new->elem);
+  return ftes[0];
+}
+
+/* Page-out daemon.  Whenever woken, evicts the pages chosen by
+   the clock algorithm and returns their frames to the user pool
+   until frame_high_water frames are free, so that page faults
+   seldom have to wait for an eviction themselves. */
+static void
+page_out (void *aux UNUSED)
+{
+  while (1)
+  {
+    sema_down (&pageout_sema);
 
-  return new;
+    lock_acquire (&frame_lock);
+    pageout_pending = false;
+    while (frame_cnt - used_cnt < frame_high_water)
+    {
+      struct frame_table_entry *fte = clock_sweep (2 * frame_cnt);
+      if (fte == NULL)
+        break;
+      lock_release (&frame_lock);
+
+      if (!evict (fte))
+      {
+        /* Swap is full.  Leave it to the faulting processes. */
+        lock_acquire (&frame_lock);
+        break;
+      }
+
+      lock_acquire (&frame_lock);
+      free_frame (fte);
+    }
+    lock_release (&frame_lock);
+  }
+}
+
+/* Pins the frame holding user page UPAGE of the running thread,
+   waiting for any eviction of it to finish, and returns it with
+   its lock held.  Returns a null pointer if UPAGE is not
+   resident. */
+struct frame_table_entry *
+frame_pin (void *upage)
+{
+  struct thread *t = thread_current ();
+  struct SPT_entry *spte;
+  struct frame_table_entry *fte = NULL;
+  void *frame;
+
+  lock_acquire (&frame_lock);
+  spte = SPT_lookup (&t->SPT, upage);
+  if (spte != NULL)
+    frame_wait_eviction (spte);
+  frame = pagedir_get_page (t->pagedir, upage);
+  if (frame != NULL)
+  {
+    /* Only this thread pins or loads its own frames, and
+       clock_sweep() and take_neighbor() unmap a frame in the same
+       critical section that takes its lock, so this does not
+       block. */
+    fte = fte_lookup (frame);
+    ASSERT (fte != NULL && fte->owner == t);
+    lock_acquire (&fte->lock);
+  }
+  lock_release (&frame_lock);
+
+  return fte;
 }
 
 bool
@@ -180,55 +554,56 @@ reclaim_page (struct SPT_entry *SPT_entry, void *upage, struct frame_table_entry
   }
 }
 
+/* Advances the clock hand up to STEPS entries looking for a frame
+   to evict, giving frames accessed since the hand last passed
+   them a second chance and skipping frames whose lock is held.
+   Returns the victim with its lock held, or a null pointer if
+   there is none within STEPS.  frame_lock must be held.
+
+   The victim's page is unmapped and marked as being evicted
+   before frame_lock is released, so that no thread finds it
+   mapped and then blocks on its lock while holding frame_lock. */
+static struct frame_table_entry *
+clock_sweep (size_t steps)
+{
+  for (size_t i = 0; i < steps; i++)
+  {
+    struct frame_table_entry *fte = &frame_table[clock_hand];
+    void *upage;
+
+    clock_hand = (clock_hand + 1) % frame_cnt;
+    if (!fte->in_use || fte->aux == NULL)
+      continue;
+
+    upage = fte->aux->page;
+    if (pagedir_is_accessed (fte->owner->pagedir, upage))
+      pagedir_set_accessed (fte->owner->pagedir, upage, false);
+    else if (lock_try_acquire (&fte->lock))
+    {
+      fte->dirty = pagedir_is_dirty (fte->owner->pagedir, upage);
+      pagedir_clear_page (fte->owner->pagedir, upage);
+      fte->aux->evicting = true;
+      return fte;
+    }
+  }
+  return NULL;
+}
+
+/* Chooses a frame to evict by the clock algorithm, sweeping
+   frame_table in physical order.  Returns the victim with its
+   lock held.  frame_lock must be held; if every frame is busy, it
+   is released while other threads make progress. */
 struct frame_table_entry*
 choose_victim (void)
 {
-  struct frame_table_entry *fte;
-  struct hash_iterator i;
-  void *upage;
-
   while (1)
   {
-    if (global_frame == NULL)
-    {
-      hash_first (&i, &frame_table);
-      hash_next (&i);
-    }
-    else
-    {
-      struct frame_table_entry *next_fte = fte_lookup (global_frame);
-      ASSERT (next_fte != NULL)
-      hash_iter_set (&i, &frame_table, &next_fte->elem);
-    }
+    struct frame_table_entry *fte = clock_sweep (2 * frame_cnt);
+    if (fte != NULL)
+      return fte;
 
-    while (1)
-    {
-      if (hash_cur (&i) == NULL)
-      {
-        global_frame = NULL;
-        break;
-      }
-      fte = hash_entry (hash_cur (&i), struct frame_table_entry, elem);
-      upage = fte->aux->page;
-      if (pagedir_is_accessed (fte->owner->pagedir, upage))
-      {
-        pagedir_set_accessed (fte->owner->pagedir, upage, false);
-        hash_next (&i);
-      }
-      else if (lock_try_acquire (&fte->lock))
-      {
-        if (hash_next (&i) == NULL)
-        {
-          global_frame = NULL;
-        }
-        else
-        {
-          struct frame_table_entry *next_fte =
-                hash_entry (hash_cur (&i), struct frame_table_entry, elem);
-          global_frame = next_fte->frame;
-        }
-        return fte;
-      }
-    }
+    lock_release (&frame_lock);
+    thread_yield ();
+    lock_acquire (&frame_lock);
   }
 }
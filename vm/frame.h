@@ -5,14 +5,29 @@
 #include "vm/suppage.h"
 #include "threads/synch.h"
 
+/* One entry per page in the user pool, indexed by the page's
+   position in the pool. */
 struct frame_table_entry {
-  struct hash_elem elem;
+  bool in_use;                  /* Frame allocated to a process? */
   struct thread *owner;
   void *frame;
   struct SPT_entry *aux;
   struct lock lock;
+  bool dirty;                   /* Page dirty when unmapped by
+                                   clock_sweep()? */
 };
 
+/* Default free-frame watermarks of the page-out daemon. */
+#define FRAME_DEFAULT_LOW_WATER 8
+#define FRAME_DEFAULT_HIGH_WATER 16
+
+/* The page-out daemon is woken when fewer than frame_low_water
+   user frames are free, and evicts pages until frame_high_water
+   are.  Controlled by kernel command-line options
+   "-pageout-low=N" and "-pageout-high=N". */
+extern size_t frame_low_water;
+extern size_t frame_high_water;
+
 void frame_table_init (void);
 
 void acquire_frame_lock (void);
@@ -21,10 +36,16 @@ void release_frame_lock (void);
 
 void frame_remove (struct frame_table_entry *fte);
 
+void frame_wait_eviction (struct SPT_entry *);
+
+struct frame_table_entry *frame_pin (void *upage);
+
 struct frame_table_entry *fte_lookup(void *frame);
 
 struct frame_table_entry *frame_alloc (enum palloc_flags);
 
+struct frame_table_entry *frame_swap_in (struct SPT_entry *, void *upage);
+
 struct frame_table_entry *choose_victim (void);
 
 bool allocate_page (void *, struct frame_table_entry *, bool);
@@ -33,13 +33,18 @@ destructor_ (struct hash_elem *e, void *aux UNUSED)
 {
   struct SPT_entry *entry = hash_entry (e, struct SPT_entry, elem);
 
+  frame_wait_eviction (entry);
   if (entry->evicted)
   {
     swap_delete (entry->index);
   }
-  else if (!entry->is_mmap)
+  else if (!entry->is_mmap && entry->frame != NULL)
   {
     struct frame_table_entry *fte = fte_lookup (entry->frame);
+
+    /* The page is not being evicted, and an evicter unmaps a page
+       in the same critical section that locks it, so only its
+       exiting owner could hold the lock. */
     lock_acquire (&fte->lock);
     frame_remove (fte);
   }
@@ -79,6 +84,7 @@ SPT_insert (void *upage, void *kpage, bool writable)
   SPT_entry->frame = kpage;
   SPT_entry->index = 0;
   SPT_entry->evicted = false;
+  SPT_entry->evicting = false;
   SPT_entry->writable = writable;
   SPT_entry->is_mmap = false;
   hash_insert (&t->SPT, &SPT_entry->elem);
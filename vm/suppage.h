@@ -10,8 +10,9 @@ struct SPT_entry
     void *page;
     void *frame;
     struct hash_elem elem;
-    size_t index;
+    size_t index;               /* Swap slot, if evicted. */
     bool evicted;
+    bool evicting;              /* Being written out by evict()? */
     bool writable;
 
     bool is_mmap;
@@ -1,74 +1,226 @@
 #include "devices/block.h"
 #include <bitmap.h>
+#include <round.h>
 #include <stdio.h>
 #include "vm/frame.h"
 #include "vm/swap.h"
+#include "threads/malloc.h"
 #include "threads/thread.h"
 #include "threads/synch.h"
 #include "userprog/pagedir.h"
+#include "vm/suppage.h"
+
+/* Swap is divided into page-sized slots, one bit each in
+   slot_map.  The slots are grouped GROUP_SLOTS at a time, and
+   group_full has a bit per group that is set while every slot in
+   the group is in use, so that a search skips a full group with a
+   single test instead of examining its slots.  Searches start
+   where the last allocation ended (next fit), which keeps the
+   slots in front of the cursor mostly free. */
+#define GROUP_SLOTS 32
 
 static struct block *global_swap_block;
-static struct bitmap *swap_bitmap;
+static struct bitmap *slot_map;         /* In-use slots. */
+static struct bitmap *group_full;       /* Groups with no free slot. */
+static size_t slot_cnt;                 /* Slots on the swap device. */
+static size_t group_cnt;                /* Groups of slots. */
+static size_t cursor;                   /* Next slot to search from. */
+static struct lock swap_lock;           /* Protects the above.  Not
+                                           held during I/O. */
 
 void
 swap_init (void)
 {
   global_swap_block = block_get_role (BLOCK_SWAP);
-  swap_bitmap = bitmap_create (block_size (global_swap_block));
-  bitmap_set_all(swap_bitmap, false);
+  slot_cnt = block_size (global_swap_block) / SWAP_PAGE_SECTORS;
+  group_cnt = DIV_ROUND_UP (slot_cnt, GROUP_SLOTS);
+  slot_map = bitmap_create (slot_cnt);
+  group_full = bitmap_create (group_cnt);
+  if (slot_map == NULL || group_full == NULL)
+    PANIC ("Cannot allocate swap slot map");
+  cursor = 0;
+  lock_init (&swap_lock);
 }
 
-void
-swap_delete(int index)
+/* Updates group_full for the groups that slots START through
+   START + CNT - 1 belong to.  swap_lock must be held. */
+static void
+update_groups (size_t start, size_t cnt)
 {
-  for (int i = 0; i < 8; ++i)
+  size_t last = (start + cnt - 1) / GROUP_SLOTS;
+
+  for (size_t g = start / GROUP_SLOTS; g <= last; g++)
   {
-    bitmap_set(swap_bitmap, index + i, false);
+    size_t first = g * GROUP_SLOTS;
+    size_t n = slot_cnt - first < GROUP_SLOTS ? slot_cnt - first
+                                              : GROUP_SLOTS;
+    bitmap_set (group_full, g, bitmap_all (slot_map, first, n));
   }
 }
 
+/* Allocates CNT consecutive free slots and returns the first, or
+   BITMAP_ERROR if there is no such run.  A run starts inside the
+   first group, beginning with the cursor's, that has a free slot
+   and room for it, though it may spill over into the next.
+   swap_lock must be held. */
+static size_t
+slot_alloc (size_t cnt)
+{
+  size_t g = cursor / GROUP_SLOTS;
 
-void
-swap_out (struct frame_table_entry *fte)
+  for (size_t i = 0; i < group_cnt; i++, g = (g + 1) % group_cnt)
+  {
+    size_t end = (g + 1) * GROUP_SLOTS;
+
+    if (bitmap_test (group_full, g))
+      continue;
+    for (size_t s = g * GROUP_SLOTS; s < end && s + cnt <= slot_cnt; s++)
+      if (!bitmap_contains (slot_map, s, cnt, true))
+      {
+        bitmap_set_multiple (slot_map, s, cnt, true);
+        update_groups (s, cnt);
+        cursor = (s + cnt) % slot_cnt;
+        return s;
+      }
+  }
+  return BITMAP_ERROR;
+}
+
+/* Frees the CNT slots starting at SLOT.  swap_lock must be
+   held. */
+static void
+slot_free (size_t slot, size_t cnt)
 {
-  ASSERT (fte != NULL);
-  void *frame = fte->frame;
-  size_t index = bitmap_scan_and_flip (swap_bitmap, 0, 8, false);
-  struct SPT_entry *SPT_entry = fte->aux;
+  ASSERT (bitmap_all (slot_map, slot, cnt));
+  bitmap_set_multiple (slot_map, slot, cnt, false);
+  update_groups (slot, cnt);
+}
 
+/* Frees SLOT, holding a page whose process has exited. */
+void
+swap_delete (size_t slot)
+{
+  lock_acquire (&swap_lock);
+  slot_free (slot, 1);
+  lock_release (&swap_lock);
+}
 
-  if (index == BITMAP_ERROR)
-    PANIC ("No more swap slots left to allocate!!");
+/* Completion function for swap I/O, whose AUX is a semaphore
+   counting completions. */
+static void
+swap_io_done (struct block_request *r)
+{
+  sema_up (r->aux);
+}
 
-  ASSERT (fte != NULL);
-  ASSERT (SPT_entry != NULL);
+/* Transfers each of the CNT frames in FTES to or from the slot
+   in SLOTS with the same index, and waits for the transfers to
+   finish.  One request is queued per page; those for consecutive
+   slots continue one another, so the disk driver merges them
+   into a single multi-sector command. */
+static void
+swap_io (struct frame_table_entry **ftes, size_t cnt, size_t *slots,
+         bool write)
+{
+  struct block_request reqs[SWAP_CLUSTER];
+  struct semaphore done;
 
-  SPT_entry->index = index;
-  SPT_entry->evicted = true;
+  ASSERT (cnt <= SWAP_CLUSTER);
 
-  for(int i = 0; i < 8; ++i)
+  sema_init (&done, 0);
+  for (size_t i = 0; i < cnt; i++)
   {
-    block_write (global_swap_block, index + i, frame + (i * BLOCK_SECTOR_SIZE));
+    struct block_request *r = &reqs[i];
+    r->write = write;
+    r->sector = slots[i] * SWAP_PAGE_SECTORS;
+    r->cnt = SWAP_PAGE_SECTORS;
+    r->buffer = ftes[i]->frame;
+    r->done = swap_io_done;
+    r->aux = &done;
+    block_submit (global_swap_block, r);
   }
-  // printf ("Page %p ", fte->aux->page);
-  // printf ("swapped out\n");
+  for (size_t i = 0; i < cnt; i++)
+    sema_down (&done);
 }
 
-void
-swap_in (struct frame_table_entry *fte, size_t index)
+bool
+swap_out (struct frame_table_entry *fte)
 {
-  ASSERT (fte != NULL);
+  return swap_out_cluster (&fte, 1);
+}
+
+/* Writes the CNT pages in FTES, which should be virtually
+   consecutive pages in address order, to consecutive swap slots
+   with a single I/O, so that swap_in_cluster() can read them back
+   together.  If no run of CNT free slots remains, each page goes
+   to whatever slot is free.  Returns false, writing nothing, if
+   swap has no room for all of the pages. */
+bool
+swap_out_cluster (struct frame_table_entry **ftes, size_t cnt)
+{
+  size_t slots[SWAP_CLUSTER];
+  size_t first;
+
+  ASSERT (ftes != NULL);
+  ASSERT (cnt > 0 && cnt <= SWAP_CLUSTER);
+
+  lock_acquire (&swap_lock);
+  first = slot_alloc (cnt);
+  if (first != BITMAP_ERROR)
+  {
+    for (size_t i = 0; i < cnt; i++)
+      slots[i] = first + i;
+  }
+  else
+  {
+    for (size_t i = 0; i < cnt; i++)
+    {
+      slots[i] = slot_alloc (1);
+      if (slots[i] == BITMAP_ERROR)
+      {
+        while (i-- > 0)
+          slot_free (slots[i], 1);
+        lock_release (&swap_lock);
+        return false;
+      }
+    }
+  }
+  lock_release (&swap_lock);
 
-  void *frame = fte->frame;
-  for (int i = 0; i < 8; ++i)
+  for (size_t i = 0; i < cnt; i++)
   {
-    ASSERT (bitmap_test(swap_bitmap, index + i));
-    block_read (global_swap_block, index + i, frame + (i * BLOCK_SECTOR_SIZE));
-    bitmap_set(swap_bitmap, index + i, false);
+    struct SPT_entry *SPT_entry = ftes[i]->aux;
+    ASSERT (SPT_entry != NULL);
+    SPT_entry->index = slots[i];
+    SPT_entry->evicted = true;
   }
 
+  swap_io (ftes, cnt, slots, true);
+  return true;
+}
+
+void
+swap_in (struct frame_table_entry *fte, size_t slot)
+{
+  swap_in_cluster (&fte, 1, slot);
+}
+
+/* Reads the CNT consecutive swap slots starting at SLOT into the
+   frames in FTES with a single I/O, and frees the slots. */
+void
+swap_in_cluster (struct frame_table_entry **ftes, size_t cnt,
+                 size_t slot)
+{
+  size_t slots[SWAP_CLUSTER];
 
+  ASSERT (ftes != NULL);
+  ASSERT (cnt > 0 && cnt <= SWAP_CLUSTER);
 
-  //printf ("Swapped In %p\n", frame);
+  for (size_t i = 0; i < cnt; i++)
+    slots[i] = slot + i;
+  swap_io (ftes, cnt, slots, false);
 
+  lock_acquire (&swap_lock);
+  slot_free (slot, cnt);
+  lock_release (&swap_lock);
 }
@@ -1,13 +1,29 @@
 #ifndef SWAP_H
 #define SWAP_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include "threads/vaddr.h"
+#include "devices/block.h"
+
+/* Sectors in one page-sized swap slot. */
+#define SWAP_PAGE_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Most pages moved to or from swap by a single I/O. */
+#define SWAP_CLUSTER 8
+
+struct frame_table_entry;
 
 void swap_init (void);
 
-void swap_out (struct frame_table_entry *);
+bool swap_out (struct frame_table_entry *);
+
+void swap_in (struct frame_table_entry *fte, size_t slot);
 
-void swap_in (struct frame_table_entry *fte, size_t index);
+bool swap_out_cluster (struct frame_table_entry **, size_t cnt);
+void swap_in_cluster (struct frame_table_entry **, size_t cnt,
+                      size_t slot);
 
-void swap_delete (int index);
+void swap_delete (size_t slot);
 
 #endif